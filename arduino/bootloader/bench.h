@@ -0,0 +1,53 @@
+// Benchmarks for the boot loader hot paths, replaces main() when built with
+// -DBENCH and runs under simavr, see simbench.c and "make bench"
+//
+// Each benchmark writes its repetition count to GPIOR0, starts by writing to
+// GPIOR1 and ends by writing its number to GPIOR2. The simulator reports the
+// cycles spent in between, divided by the repetition count.
+
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#define BENCH_START(reps) do { GPIOR0 = (reps); GPIOR1 = 0; } while (0)
+#define BENCH_STOP(id)    do { GPIOR2 = (id); } while (0)
+
+static volatile uint16_t benchResult; // keeps results from being optimized away
+
+int main(void) __attribute__ ((OS_main)) __attribute__ ((section (".init9")));
+
+int main () {
+  asm volatile ("clr __zero_reg__");
+
+  spi_initialize();
+
+  // 0: CRC check over 30 KB of flash, as done in appIsValid()
+  BENCH_START(1);
+  benchResult = calcCRC(BASE_ADDR, 30 * 1024, 1);
+  BENCH_STOP(0);
+
+  // 1: erasing and writing one page of flash
+  BENCH_START(4);
+  for (uint8_t i = 0; i < 4; ++i)
+    writeFlash(BASE_ADDR + 0x1000 + i * PAGE_SIZE);
+  BENCH_STOP(1);
+
+  // 2: one received byte in the RFM12B interrupt handler
+  rxstate = TXRECV;
+  rxfill = 3;
+  rf12_len = RF12_MAXDATA;
+  BENCH_START(64);
+  for (uint8_t i = 0; i < 64; ++i)
+    rf12_interrupt();
+  BENCH_STOP(2);
+
+  // 3: de-whitening one download packet
+  BENCH_START(1);
+  dewhiten(rf12_data + 2);
+  BENCH_STOP(3);
+
+  // sleeping with interrupts disabled ends the simulation
+  cli();
+  sleep_enable();
+  sleep_cpu();
+  return 0;
+}
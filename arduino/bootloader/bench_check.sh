@@ -0,0 +1,27 @@
+#!/bin/sh
+# compare "name value" lines on stdin with the same names in a baseline file,
+# fails if any value grew by more than the tolerance, in percent (default 2)
+#
+# usage: bench_check.sh <baseline> [tolerance]
+
+awk -v base="$1" -v tol="${2:-2}" '
+  BEGIN {
+    while ((getline line < base) > 0) {
+      split(line, f)
+      was[f[1]] = f[2]
+    }
+  }
+  {
+    line = sprintf("%-22s %10d", $1, $2)
+    if (was[$1] > 0) {
+      d = 100 * ($2 - was[$1]) / was[$1]
+      line = line sprintf("  baseline %10d %+7.1f%%", was[$1], d)
+      if (d > tol) {
+        line = line "  REGRESSION"
+        bad = 1
+      }
+    }
+    print line
+  }
+  END { exit bad }
+'
@@ -40,6 +40,8 @@ static void flash_led(uint8_t count) {
 # define UART_SRC UCSR0C
 # define UART_SRL UBRR0L
 # define UART_UDR UDR0
+// baud rate register value for double speed mode at the given clock rate
+#define UART_UBRR(f) ((uint8_t) (((f) + BAUD_RATE * 4L) / (BAUD_RATE * 8L) - 1))
 
 // print character
 static void putch(char ch) {
@@ -11,35 +11,41 @@
 #define CONFIG_ADDR (BASE_ADDR - sizeof(config)) // where config goes
 
 #define MAX_BACKOFF 4                     // std:12 -- 61*(2**MAX_BACKOFF) milliseconds
+#define PUSH_ACK_EVERY 8                  // chunks between acks in push mode
 
-static uint16_t calcCRC (const void *start, int len) {
-	const uint8_t *ptr = start;
-  int crc = ~0;
-	while (len--)
-    crc = _crc16_update(crc, *ptr++);
-  //P("  crc "); P_X16(crc); P_LN();
-  return crc;
-}
-
-// calculate the CRC of a block in flash, len must be a multiple of 2!
-static uint16_t calcFlashCRC (const void *start, int len) {
+// calculate the CRC of a block in RAM or, if inFlash is set, in program memory
+static uint16_t calcCRC (const void *start, uint16_t len, uint8_t inFlash) {
 	const uint8_t *ptr = start;
   uint16_t crc = ~0;
 	while (len--) {
-		uint8_t b = pgm_read_byte_near(ptr++);
+		uint8_t b = inFlash ? pgm_read_byte_near(ptr) : *ptr;
+		++ptr;
     crc = _crc16_update(crc, b);
 	}
   //P("  crc "); P_X16(crc); P_LN();
   return crc;
 }
 
+// copy a block from program memory into RAM
+static void readFlash (void *ram, const void *flash, uint8_t len) {
+	uint8_t *dst = ram;
+	const uint8_t *src = flash;
+	while (len--)
+		*dst++ = pgm_read_byte_near(src++);
+}
+
 //===== Communication =====
 
+// send a boot packet without waiting for anything to come back
+static void sendPacket (const void* buf, int len, int hdrOr) {
+  rf12_sendNow(RF12_HDR_CTL | RF12_HDR_ACK | hdrOr, buf, len);
+  rf12_sendWait(0);
+}
+
 // return 1 if good reply, 0 if crc error, -1 if timeout
 static int sendRequest (const void* buf, int len, int hdrOr) {
   P("SND "); P_X8(len); P("->");
-  rf12_sendNow(RF12_HDR_CTL | RF12_HDR_ACK | hdrOr, buf, len);
-  rf12_sendWait(0);
+  sendPacket(buf, len, hdrOr);
 	timer_start(250); // arm timer for 250ms
   while (!rf12_recvDone() || rf12_len == 0) // TODO: 0-check to avoid std acks?
     if (timer_done()) {
@@ -58,7 +64,12 @@ static int sendRequest (const void* buf, int len, int hdrOr) {
 
 // Buffer to accumulate data packets untilwe can write a full page. Allocate  bit extra
 // to allow for odd radio packet sizes since we've got enough RAM...
+#if DELTA_MODE
+// delta updates use the second page to hold the old content of the page written last
+static uint16_t flashBuffer[PAGE_SIZE];
+#else
 static uint16_t flashBuffer[(PAGE_SIZE+BOOT_DATA_MAX+1)/2];   // buffer for a full page of flash
+#endif
 
 // Write a complete buffer to flash
 // TODO: optimize for RWW section to erase while requesting data
@@ -97,7 +108,7 @@ static void flushFlash(void *flash) {
 	uint16_t offset = (uint16_t)flash & (PAGE_SIZE-1);
 	//P("FL "); P_X16((uint16_t)flash); P_LN();
 	if (offset != 0) {
-		memset(flashBuffer+offset/2, 0xFF, PAGE_SIZE-offset);   // fill rest of buffer with 1's
+		memset((uint8_t*) flashBuffer+offset, 0xFF, PAGE_SIZE-offset);   // fill rest of buffer with 1's
 		writeFlash(flash-offset);
 	}
 }
@@ -141,13 +152,11 @@ struct Config {
 
 static void loadConfig () {
   // copy config from program memory to config struct
-	for (uint8_t i=0; i<sizeof(config); i++) {
-		((uint8_t*)&config)[i] = pgm_read_byte_near(CONFIG_ADDR+i);
-	}
+	readFlash(&config, CONFIG_ADDR, sizeof config);
 	P("Config ");
   P_A(&config, sizeof config);
 	// calculate checksum to verify it's valid
-  if (calcCRC(&config, sizeof config) != 0) {
+  if (calcCRC(&config, sizeof config, 0) != 0) {
     P("DEF!\n");
     memset(&config, 0, sizeof config);
   }
@@ -156,14 +165,12 @@ static void loadConfig () {
 // Saves config by inserting it into the end of the last page program memory (flash)
 static void saveConfig () {
   config.version = 1;
-  if (calcCRC(&config, sizeof config) != 0) {
-    config.check = calcCRC(&config, sizeof config - 2);
+  if (calcCRC(&config, sizeof config, 0) != 0) {
+    config.check = calcCRC(&config, sizeof config - 2, 0);
     //P("save config 0x"); P_X16(config.check); P_LN();
 		//P("config @0x"); P_A(&config, sizeof(config));
 		// Load last page of program memory
-		uint8_t *tgt = (uint8_t *)flashBuffer;
-		for (uint8_t i=0; i<PAGE_SIZE; i++)
-				tgt[i] = pgm_read_byte_near(BASE_ADDR-PAGE_SIZE+i);
+		readFlash(flashBuffer, BASE_ADDR-PAGE_SIZE, PAGE_SIZE);
 		// Slap config on top and flash it!
 		fillFlash(CONFIG_ADDR, &config, sizeof(config));
   }
@@ -177,7 +184,7 @@ static void sendPairingCheck () {
   request.type = REMOTE_TYPE;
   request.group = config.group;
   request.nodeId = config.nodeId;
-  request.check = calcCRC(&config.shKey, sizeof config.shKey);
+  request.check = calcCRC(&config.shKey, sizeof config.shKey, 0);
   memcpy(request.hwId, hwId, sizeof request.hwId);
   
 	// send the message and assuming we get a reply, set the config from the reply
@@ -195,25 +202,79 @@ static void sendPairingCheck () {
 //===== Upgrade =====
 
 static int appIsValid () {
-  //return calcCRC(BASE_ADDR, config.swSize << 4) == config.swCheck;
-  uint16_t curr = calcFlashCRC(BASE_ADDR, config.swSize << 4);
+  setClock(CLOCK_FAST);
+  uint16_t curr = calcCRC(BASE_ADDR, config.swSize << 4, 1);
+  setClock(CLOCK_RADIO);
 	P("SW="); P_X16(curr);
 	P(" want="); P_X16(config.swCheck);
 	P(curr == config.swCheck ? " OK\n" : " NO\n");
 	return curr == config.swCheck;
 }
 
+static uint8_t pushMode; // set if the server streams the download to us
+#if BCAST_MODE
+static uint8_t bcastMode; // set if the download is broadcast to the group
+#endif
+#if CODED_MODE
+static uint8_t codedMode; // set if the broadcast is coded
+#endif
+#if DELTA_MODE
+static uint8_t appValid;       // set if our image can be the base of a delta
+static uint16_t deltaChunks;   // chunks of delta ops to download, 0 for an image
+#endif
+
+// return 1 if the config is up to date, 0 if no reply, -1 if told to wait
 static int sendUpgradeCheck () {
-	// form upgrade check message
-  struct UpgradeRequest request;
-  request.type = REMOTE_TYPE;
-  request.swId = config.swId;
-  request.swSize = config.swSize;
-  request.swCheck = config.swCheck;
+	// form upgrade check message, with the flags appended if we support any
+#if PUSH_MODE || BUSY_WAIT || DELTA_MODE || BCAST_MODE
+  struct UpgradeRequestPush request;
+  request.flags = (PUSH_MODE ? UPGRADE_PUSH : 0) | (BUSY_WAIT ? UPGRADE_BUSY : 0) |
+                  (BCAST_MODE ? UPGRADE_BCAST : 0) | (CODED_MODE ? UPGRADE_CODED : 0);
+#if DELTA_MODE
+  if (appValid)
+    request.flags |= UPGRADE_DELTA;
+#endif
+#else
+  struct { struct UpgradeRequest req; } request;
+#endif
+  request.req.type = REMOTE_TYPE;
+  request.req.swId = config.swId;
+  request.req.swSize = config.swSize;
+  request.req.swCheck = config.swCheck;
 	// send the message and update the config based on the reply, if we get one
   struct UpgradeReply *reply;
-  if (sendRequest(&request, sizeof request, 0) > 0 && rf12_len == sizeof(*reply)) {
+  int ok = sendRequest(&request, sizeof request, 0) > 0;
+#if BUSY_WAIT
+  if (ok && rf12_len == sizeof(struct UpgradeReplyBusy) &&
+      (((struct UpgradeReplyBusy *)rf12_data)->flags & UPGRADE_BUSY)) {
+    uint8_t retry = ((struct UpgradeReplyBusy *)rf12_data)->retry;
+    P("Busy "); P_X8(retry); P_LN();
+    sleep(1000L * retry);
+    return -1;
+  }
+#endif
+  if (ok && (rf12_len == sizeof(*reply)
+        || ((PUSH_MODE || BCAST_MODE) && rf12_len == sizeof(struct UpgradeReplyPush))
+        || (DELTA_MODE && rf12_len == sizeof(struct UpgradeReplyDelta)))) {
 		reply = (struct UpgradeReply *)rf12_data;
+#if PUSH_MODE
+    pushMode = rf12_len >= sizeof(struct UpgradeReplyPush) &&
+                (((struct UpgradeReplyPush *)rf12_data)->flags & UPGRADE_PUSH);
+#endif
+#if BCAST_MODE
+    bcastMode = rf12_len == sizeof(struct UpgradeReplyPush) &&
+                (((struct UpgradeReplyPush *)rf12_data)->flags & UPGRADE_BCAST);
+#endif
+#if CODED_MODE
+    codedMode = bcastMode &&
+                (((struct UpgradeReplyPush *)rf12_data)->flags & UPGRADE_CODED);
+#endif
+#if DELTA_MODE
+    deltaChunks = 0;
+    if (rf12_len == sizeof(struct UpgradeReplyDelta) &&
+        (((struct UpgradeReplyDelta *)rf12_data)->flags & UPGRADE_DELTA))
+      deltaChunks = ((struct UpgradeReplyDelta *)rf12_data)->chunks;
+#endif
     config.swId = reply->swId;
     config.swSize = reply->swSize;
     config.swCheck = reply->swCheck;
@@ -228,27 +289,420 @@ static int sendUpgradeCheck () {
 
 //===== Download =====
 
+// de-whitening (prevents simple runs of all-0 or all-1 bits)
+static void dewhiten (volatile uint8_t *data) {
+	uint8_t w = 0;
+  for (uint8_t i = 0; i < BOOT_DATA_MAX; ++i) {
+    data[i] ^= w;
+    w += 211;
+  }
+}
+
+#if DELTA_MODE
+// Delta updates: the op being applied carries over from one chunk to the next
+static uint16_t outPos;       // offset in flash of the next byte to write
+static uint16_t deltaLeft;    // bytes still to append for the current op
+static uint8_t deltaOp;       // current op
+static uint8_t deltaFill;     // operand bytes collected, plus one for the op
+static uint8_t deltaArg [4];
+
+#define OLD_PAGE ((uint8_t*) flashBuffer + PAGE_SIZE)
+
+// append a byte to the new image, keep the old content of each page written
+static void putByte (uint8_t b) {
+  ((uint8_t*) flashBuffer)[outPos & (PAGE_SIZE-1)] = b;
+  if ((++outPos & (PAGE_SIZE-1)) == 0) {
+    void* flash = BASE_ADDR + outPos - PAGE_SIZE;
+    readFlash(OLD_PAGE, flash, PAGE_SIZE);
+    writeFlash(flash);
+  }
+}
+
+// read a byte of the old image, from RAM if its page was just overwritten
+static uint8_t oldByte (uint16_t src) {
+  uint16_t last = (outPos & ~(PAGE_SIZE-1)) - PAGE_SIZE;
+  if (outPos >= PAGE_SIZE && (uint16_t)(src - last) < PAGE_SIZE)
+    return OLD_PAGE[src - last];
+  return pgm_read_byte_near(BASE_ADDR + src);
+}
+
+// feed the next byte of delta ops
+static void applyDelta (uint8_t b) {
+  if (deltaLeft > 0) { // only literals wait for more input
+    putByte(b);
+    --deltaLeft;
+    return;
+  }
+  if (deltaFill == 0) {
+    deltaOp = b;
+    if (b != DELTA_END)
+      deltaFill = 1;
+    return;
+  }
+  deltaArg[deltaFill++ - 1] = b;
+  uint8_t n = deltaOp == DELTA_COPY ? 4 : deltaOp == DELTA_RUN ? 3 : 2;
+  if (deltaFill <= n)
+    return;
+  deltaFill = 0;
+  deltaLeft = deltaArg[n-2] | (deltaArg[n-1] << 8);
+  uint16_t src = deltaArg[0] | (deltaArg[1] << 8);
+  // copies and runs need no more input, append their bytes right away
+  for (; deltaLeft > 0 && deltaOp != DELTA_LIT; --deltaLeft)
+    putByte(deltaOp == DELTA_COPY ? oldByte(src++) : deltaArg[0]);
+}
+#endif
+
+// copy the download reply just received to flash, if it's the given chunk,
+// and addressed to us: broadcasts to the group can have the same swIdXor
+static int storeChunk (uint16_t index) {
+  if (rf12_len != sizeof(struct DownloadReply) || !(rf12_hdr & RF12_HDR_DST) ||
+			*(uint16_t*)rf12_data != (config.swId ^ index)) // check reply.swIdXor
+    return 0;
+	setClock(CLOCK_FAST);
+  dewhiten(rf12_data+2);
+  void* flash = BASE_ADDR + BOOT_DATA_MAX * index;
+#if DELTA_MODE
+  if (deltaChunks)
+    for (uint8_t i = 0; i < BOOT_DATA_MAX; ++i)
+      applyDelta(rf12_data[2+i]);
+  else
+#endif
+  fillFlash(flash, (const void *)(rf12_data+2), BOOT_DATA_MAX);
+	setClock(CLOCK_RADIO);
+	P("F "); P_X8(index); P(" @"); P_X16((uint16_t)flash); P_LN();
+  return 1;
+}
+
 static int sendDownloadRequest (int index) {
 	// Compose download request
   struct DownloadRequest request;
   request.swId = config.swId;
   request.swIndex = index;
 	// Send request and if we got a reply copy it to flash
-  if (sendRequest(&request, sizeof request, 0) > 0 &&
-			rf12_len == sizeof(struct DownloadReply) &&
-			*(uint16_t*)rf12_data == (request.swId ^ request.swIndex)) // check reply.swIdXor
-	{
-		// de-whitening (prevents simple runs of all-0 or all-1 bits)
-    for (int i = 0; i < BOOT_DATA_MAX; ++i)
-      rf12_data[2+i] ^= 211 * i;
-    void* flash = BASE_ADDR + BOOT_DATA_MAX * index;
-    fillFlash(flash, (const void *)(rf12_data+2), BOOT_DATA_MAX);
-		P("F "); P_X8(request.swIndex); P(" @"); P_X16((uint16_t)flash); P_LN();
+  return sendRequest(&request, sizeof request, 0) > 0 && storeChunk(index);
+}
+
+#if PUSH_MODE
+// ack all chunks before index, or ask for a resend from there with PUSH_HOLE
+static void sendAck (uint16_t index) {
+  struct DownloadRequest ack;
+  ack.swId = config.swId;
+  ack.swIndex = index;
+  P("ACK "); P_X16(index); P_LN();
+  sendPacket(&ack, sizeof ack, 0);
+}
+
+// Push mode: the server streams the chunks, we stay in receive mode and only
+// send an ack every few chunks. Chunks are still stored strictly in order: a
+// gap gets one hole report, after which the server resends from the gap. When
+// nothing arrives for 250ms, the hole report is repeated with back-off.
+// Returns 0 if the server went away, 1 when all chunks have been stored.
+static int receiveDownload (uint16_t limit) {
+  uint16_t next = 0, hole = ~0;
+  uint8_t unacked = 0;
+  backOffCounter = 0;
+	uint8_t deadline = 73; // 73->abort after ~ 4 hours
+  sendAck(0);
+  timer_start(250);
+  while (next < limit) {
+    if (rf12_recvDone()) {
+      if (rf12_crc != 0 || rf12_len != sizeof(struct DownloadReply) ||
+          !(rf12_hdr & RF12_HDR_DST)) // a broadcast, not our stream
+        continue;
+      uint16_t index = *(uint16_t*)rf12_data ^ config.swId;
+      if (index == next && storeChunk(next)) {
+        ++next;
+        backOffCounter = 0;
+        deadline = 73;
+        if (++unacked >= PUSH_ACK_EVERY) {
+          sendAck(next);
+          unacked = 0;
+        }
+        timer_start(250); // the clock was switched while storing the chunk
+      } else if (index > next && index < limit && hole != next) {
+        sendAck(next | PUSH_HOLE);
+        hole = next;
+      }
+    } else if (timer_done()) {
+      if (--deadline == 0)
+        return 0;
+      exponentialBackOff();
+      sendAck(next | PUSH_HOLE);
+      hole = next;
+      unacked = 0;
+      timer_start(250);
+    }
+  }
+  sendAck(limit); // tells the server the stream is complete
+  return 1;
+}
+#endif
+
+#if BCAST_MODE
+// Broadcast mode: the chunks are shared with other nodes and come in any order,
+// each one is written to its page right away, a bitmap tracks which ones we
+// have. The server runs one session per group, replies addressed to other
+// nodes are ignored. Nodes in a session all notice the end of a round at the
+// same time, so each waits a little longer, by node ID, before its repair
+// requests, to keep them from colliding.
+#define REPAIR_SPREAD 10 // ms between the repair requests of successive node IDs
+
+static uint8_t bcastHave [(32768/BOOT_DATA_MAX+7)/8];
+
+// write a chunk to its place in flash, keeping the rest of the page
+static void writeChunk (uint16_t index, const void *ram) {
+  uint16_t addr = BOOT_DATA_MAX * index;
+  uint16_t page = addr & ~(PAGE_SIZE-1);
+  readFlash(flashBuffer, BASE_ADDR + page, PAGE_SIZE);
+  memcpy((uint8_t*) flashBuffer + (addr - page), ram, BOOT_DATA_MAX);
+  writeFlash(BASE_ADDR + page);
+}
+
+// write the chunk just received to its place in flash
+static void patchFlash (uint16_t index) {
+	setClock(CLOCK_FAST);
+  dewhiten(rf12_data+2);
+  writeChunk(index, (const void *)(rf12_data+2));
+	setClock(CLOCK_RADIO);
+	P("B "); P_X8(index); P_LN();
+}
+
+// ask for the missing chunks, one repair request per 64 chunks with any gaps
+static void sendRepairs (uint16_t limit) {
+  struct RepairRequest request;
+  request.swId = config.swId;
+  for (uint16_t base = 0; base < limit; base += 64) {
+    uint8_t any = 0;
+    for (uint8_t i = 0; i < 8; ++i)
+      any |= request.missing[i] = ~bcastHave[base/8 + i];
+    if (any) {
+      request.base = base;
+      P("REP "); P_X16(base); P_LN();
+      sendPacket(&request, sizeof request, 0);
+    }
+  }
+}
+
+// returns 1 when all chunks are in, 0 if nothing new arrives for too long
+static int receiveBroadcast (uint16_t limit) {
+  uint16_t have = 0;
+  memset(bcastHave, 0, sizeof bcastHave);
+  for (uint16_t i = limit; i & 63; ++i) // chunks past the end are not missing
+    bcastHave[i/8] |= bit(i%8);
+	uint8_t deadline = 20; // 20->abort after 20s without progress
+  timer_start(1000);
+  while (have < limit) {
+    if (rf12_recvDone()) {
+      if (rf12_crc != 0 || rf12_len != sizeof(struct DownloadReply) ||
+          (rf12_hdr & RF12_HDR_DST))
+        continue;
+      uint16_t index = *(uint16_t*)rf12_data ^ config.swId;
+      if (index < limit && !(bcastHave[index/8] & bit(index%8))) {
+        patchFlash(index);
+        bcastHave[index/8] |= bit(index%8);
+        ++have;
+        deadline = 20;
+        // the clock was switched while writing flash
+        timer_start(1000 + REPAIR_SPREAD * (config.nodeId & RF12_HDR_MASK));
+      }
+    } else if (timer_done()) {
+      // nothing new for a second, the round is over: ask for what's missing
+      if (--deadline == 0)
+        return 0;
+      sendRepairs(limit);
+      timer_start(1000 + REPAIR_SPREAD * (config.nodeId & RF12_HDR_MASK));
+    }
+  }
+  // leave the last page in the buffer, so that flushFlash writes it unchanged
+  readFlash(flashBuffer, BASE_ADDR + ((BOOT_DATA_MAX*limit) & ~(PAGE_SIZE-1)), PAGE_SIZE);
+  return 1;
+}
+#endif
+
+#if CODED_MODE
+// Coded broadcasts: each symbol is the xor of the chunks its seed picks, see
+// packet.h. A symbol with only one of those chunks still missing yields that
+// chunk, it is decoded right away. With more, it is pending: the seed goes in
+// a small table, the data is parked in flash, in the place of one of its
+// missing chunks. When that chunk is decoded, the symbol moves to the place of
+// another one, or is dropped if there is none. A pending symbol is decoded in
+// its place once all its other chunks are in. bcastHave marks decoded chunks.
+// Symbols which arrive while the table is full are lost, which is why this
+// needs far more symbols than chunks on a lossy link, see packet.h.
+#define LT_MAX_DEGREE 30  // most chunks in one symbol, must match the server
+#define LT_MAX_PENDING 32 // pending symbols kept, later ones are dropped
+
+// cumulative probabilities (out of 65536) of each degree, must match the server
+static const uint16_t ltCdf [] PROGMEM = { 13107, 19660, 26214, 36044, 45875, 55705, 65535 };
+static const uint8_t ltDegree [] PROGMEM = { 2, 3, 4, 6, 10, 18, 30 };
+
+static uint16_t ltChunks;     // chunks in the image
+static uint16_t ltHave;       // chunks decoded so far
+static uint16_t ltState;      // random generator
+static uint16_t ltLast;       // a missing chunk, set by ltMissing
+static uint16_t ltNeigh [LT_MAX_DEGREE]; // chunks in the current symbol
+static uint8_t ltParked [(32768/BOOT_DATA_MAX+7)/8]; // places used by pending symbols
+static struct { uint16_t seed, slot; } ltPending [LT_MAX_PENDING];
+static uint8_t ltCount;       // pending symbols
+static uint8_t ltTmp [BOOT_DATA_MAX];
+
+static uint8_t isSet (const uint8_t *map, uint16_t i) {
+  return map[i/8] & bit(i%8);
+}
+
+static uint16_t ltRand () {
+  uint16_t x = ltState;
+  x ^= x << 7;
+  x ^= x >> 9;
+  x ^= x << 8;
+  return ltState = x;
+}
+
+// fill ltNeigh with the chunks in a symbol, return how many there are
+static uint8_t ltNeighbors (uint16_t seed) {
+  ltNeigh[0] = seed;
+  if (seed < ltChunks)
     return 1;
+  ltState = seed ^ 0xACE1;
+  if (ltState == 0)
+    ltState = 1;
+  uint16_t r = ltRand();
+  uint8_t i = 0;
+  while (i < sizeof ltDegree - 1 && r >= pgm_read_word(ltCdf + i))
+    ++i;
+  uint8_t d = pgm_read_byte(ltDegree + i);
+  if (d > ltChunks)
+    d = ltChunks;
+  for (uint8_t n = 0; n < d; ) {
+    uint16_t c = ltRand() % ltChunks;
+    uint8_t j = 0;
+    while (j < n && ltNeigh[j] != c)
+      ++j;
+    if (j == n)
+      ltNeigh[n++] = c;
   }
-  return 0;
+  return d;
+}
+
+// count the chunks of the current symbol which are still missing
+static uint8_t ltMissing (uint8_t d) {
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < d; ++i)
+    if (!isSet(bcastHave, ltNeigh[i])) {
+      ltLast = ltNeigh[i];
+      ++n;
+    }
+  return n;
 }
 
+// xor the decoded chunks of the current symbol out of its data
+static void ltXor (uint8_t *data, uint8_t d) {
+  for (uint8_t i = 0; i < d; ++i)
+    if (isSet(bcastHave, ltNeigh[i])) {
+      const uint8_t *p = BASE_ADDR + BOOT_DATA_MAX * ltNeigh[i];
+      for (uint8_t j = 0; j < BOOT_DATA_MAX; ++j)
+        data[j] ^= pgm_read_byte_near(p + j);
+    }
+}
+
+// store a decoded chunk, after moving the symbol parked in its place, if any
+static void ltStore (uint16_t c, const uint8_t *data) {
+  if (isSet(ltParked, c)) {
+    uint8_t e = 0;
+    while (ltPending[e].slot != c)
+      ++e;
+    ltParked[c/8] &= ~bit(c%8);
+    readFlash(ltTmp, BASE_ADDR + BOOT_DATA_MAX * c, BOOT_DATA_MAX);
+    uint8_t d = ltNeighbors(ltPending[e].seed), i = 0;
+    while (i < d && (ltNeigh[i] == c || isSet(bcastHave, ltNeigh[i]) ||
+                     isSet(ltParked, ltNeigh[i])))
+      ++i;
+    if (i < d) {
+      writeChunk(ltNeigh[i], ltTmp);
+      ltParked[ltNeigh[i]/8] |= bit(ltNeigh[i]%8);
+      ltPending[e].slot = ltNeigh[i];
+    } else
+      ltPending[e] = ltPending[--ltCount];
+  }
+  writeChunk(c, data);
+  bcastHave[c/8] |= bit(c%8);
+  ++ltHave;
+  P("L "); P_X8(c); P_LN();
+}
+
+// decode the pending symbols whose only missing chunk is their own place
+static void ltSweep () {
+  uint8_t e = 0;
+  while (e < ltCount) {
+    uint8_t d = ltNeighbors(ltPending[e].seed);
+    if (ltMissing(d) > 1) {
+      ++e;
+      continue;
+    }
+    uint16_t slot = ltPending[e].slot;
+    readFlash(ltTmp, BASE_ADDR + BOOT_DATA_MAX * slot, BOOT_DATA_MAX);
+    ltXor(ltTmp, d);
+    ltPending[e] = ltPending[--ltCount];
+    ltParked[slot/8] &= ~bit(slot%8); // so that ltStore leaves ltTmp alone
+    ltStore(slot, ltTmp);
+    e = 0; // earlier symbols may be decodable now
+  }
+}
+
+// handle one symbol, its data is modified
+static void ltReceive (uint16_t seed, uint8_t *data) {
+  uint8_t d = ltNeighbors(seed);
+  uint8_t n = ltMissing(d);
+  if (n == 1) {
+    ltXor(data, d);
+    ltStore(ltLast, data);
+    ltSweep();
+  } else if (n > 1 && ltCount < LT_MAX_PENDING) {
+    for (uint8_t i = 0; i < d; ++i) {
+      uint16_t c = ltNeigh[i];
+      if (!isSet(bcastHave, c) && !isSet(ltParked, c)) {
+        writeChunk(c, data);
+        ltParked[c/8] |= bit(c%8);
+        ltPending[ltCount].seed = seed;
+        ltPending[ltCount++].slot = c;
+        break;
+      }
+    }
+  }
+}
+
+// returns 1 when all chunks are decoded, 0 if no symbols arrive for too long
+static int receiveCoded (uint16_t limit) {
+  ltChunks = limit;
+  ltHave = ltCount = 0;
+  memset(bcastHave, 0, sizeof bcastHave);
+  memset(ltParked, 0, sizeof ltParked);
+	uint8_t deadline = 20; // 20->abort after 20s without symbols
+  timer_start(1000);
+  while (ltHave < limit) {
+    if (rf12_recvDone()) {
+      if (rf12_crc != 0 || rf12_len != sizeof(struct DownloadReply) ||
+          (rf12_hdr & RF12_HDR_DST))
+        continue;
+      uint16_t seed = *(uint16_t*)rf12_data ^ config.swId;
+      setClock(CLOCK_FAST);
+      dewhiten(rf12_data+2);
+      ltReceive(seed, (uint8_t*) rf12_data+2);
+      setClock(CLOCK_RADIO);
+      deadline = 20;
+      timer_start(1000); // the clock was switched while decoding
+    } else if (timer_done()) {
+      if (--deadline == 0)
+        return 0;
+      timer_start(1000);
+    }
+  }
+  // leave the last page in the buffer, so that flushFlash writes it unchanged
+  readFlash(flashBuffer, BASE_ADDR + ((BOOT_DATA_MAX*limit) & ~(PAGE_SIZE-1)), PAGE_SIZE);
+  return 1;
+}
+#endif
+
 //===== Boot process =====
 
 static void bootLoaderLogic () {
@@ -257,7 +711,7 @@ static void bootLoaderLogic () {
 top:
   
 	// Pairing: figure out who we're supposed to communicate with (and boot from)
-  rf12_initialize(1, RF12_BAND, PAIRING_GROUP);
+  rf12_retune(1, PAIRING_GROUP);
 
   P("==Pair\n");
   backOffCounter = 0;
@@ -269,12 +723,18 @@ top:
   }
   
 	// Upgrade check: figure out whether we have the right sketch loaded
-  rf12_initialize(config.nodeId, RF12_BAND, config.group);
+  rf12_retune(config.nodeId, config.group);
 
   P("==Upgrade\n");
   backOffCounter = 0;
 	uint8_t deadline = 73; // 73->abort after ~ 4 hours
-  while (!sendUpgradeCheck()) {
+#if DELTA_MODE
+  appValid = appIsValid();
+#endif
+  int upgrade;
+  while ((upgrade = sendUpgradeCheck()) <= 0) {
+    if (upgrade < 0)
+      continue; // the server is alive, it told us how long to wait
 		if (--deadline == 0) goto top;
     exponentialBackOff();
   }
@@ -283,6 +743,29 @@ top:
   P("==Download\n");
   if (! appIsValid()) {
     int limit = ((config.swSize << 4) + BOOT_DATA_MAX - 1) / BOOT_DATA_MAX;
+#if DELTA_MODE
+    outPos = deltaLeft = deltaFill = 0;
+    if (deltaChunks)
+      limit = deltaChunks;
+#endif
+#if CODED_MODE
+    if (codedMode) {
+      if (!receiveCoded(limit))
+        goto top;
+    } else
+#endif
+#if BCAST_MODE
+    if (bcastMode) {
+      if (!receiveBroadcast(limit))
+        goto top;
+    } else
+#endif
+#if PUSH_MODE
+    if (pushMode) {
+      if (!receiveDownload(limit))
+        goto top;
+    } else
+#endif
     for (int i = 0; i < limit; ++i) {
       backOffCounter = 0;
 		  uint8_t deadline = 73; // 73->abort after ~ 4 hours
@@ -291,6 +774,11 @@ top:
         exponentialBackOff();
 			}
     }
+#if DELTA_MODE
+    if (deltaChunks)
+      flushFlash(BASE_ADDR + outPos);
+    else
+#endif
 		flushFlash(BASE_ADDR + BOOT_DATA_MAX*limit);
   }
 
@@ -299,6 +787,9 @@ top:
 
 static void bootLoader () {
   sleep(20); // needed to make RFM69 work properly on power-up
+
+  // the slow power-up init is only done once, later phases just retune
+  rf12_initialize(1, RF12_BAND, PAIRING_GROUP);
   
   // this will not catch the runaway case when the server replies with data,
   // but the application that ends up in memory does not match the crc given
@@ -65,6 +65,9 @@ extern volatile uint8_t rf12_buf[]; // recv/xmit buf including hdr & crc bytes
 // call this once with the node ID, frequency band, and optional group
 static void rf12_initialize(uint8_t id, uint8_t band, uint8_t group);
 
+// call this to switch to a different node ID and group after initialization
+static void rf12_retune(uint8_t id, uint8_t group);
+
 // call this frequently, returns true if a packet has been received
 static uint8_t rf12_recvDone(void);
 
@@ -158,6 +161,18 @@ static volatile int8_t rxstate;     // current transceiver state
 volatile uint16_t rf12_crc;         // running crc value
 volatile uint8_t rf12_buf[RF_MAX];  // recv/xmit buf, including hdr & crc bytes
 
+// call this after every clock change, the system runs at F_CPU >> clkDiv
+static void spi_setClock (uint8_t clkDiv) {
+#ifdef SPCR    
+    // stay at 2 MHz or less to avoid exceeding RF12's SPI specs of 2.5 MHz
+    SPSR |= _BV(SPI2X);
+    if ((F_CPU >> clkDiv) <= 4000000)
+        SPCR = _BV(SPE) | _BV(MSTR);                // clk/2
+    else
+        SPCR = _BV(SPE) | _BV(MSTR) | _BV(SPR0);    // clk/8
+#endif
+}
+
 static void spi_initialize () {
     bitSet(SS_PORT, SS_BIT);
     bitSet(SS_DDR, SS_BIT);
@@ -169,14 +184,7 @@ static void spi_initialize () {
     // pinMode(SPI_SCK, OUTPUT);
     DDRB |= bit(2) | bit(3) | bit(4) | bit(5);
 #ifdef SPCR    
-#if F_CPU <= 10000000
-    // clk/4 is ok for the RF12's SPI
-    SPCR = _BV(SPE) | _BV(MSTR);
-#else
-    // use clk/8 (2x 1/16th) to avoid exceeding RF12's SPI specs of 2.5 MHz
-    SPCR = _BV(SPE) | _BV(MSTR) | _BV(SPR0);
-    SPSR |= _BV(SPI2X);
-#endif
+    spi_setClock(clockDiv);
 #else
     // ATtiny
     USICR = bit(USIWM0);
@@ -319,14 +327,32 @@ static void rf12_sendStart (uint8_t hdr, const void* ptr, uint8_t len) {
     rf12_xfer(RF_XMITTER_ON); // bytes will be fed via interrupts
 }
 
+/*
+  Change the node ID and group without going through a full re-initialization,
+  only the sync word and FIFO mode need to be changed for a new group.
+*/
+static void rf12_retune (uint8_t id, uint8_t g) {
+    nodeid = id;
+    group = g;
+		P("RF12 id="); P_X8(id); P(" g="); P_X8(g); P_LN();
+
+    rf12_xfer(RF_IDLE_MODE);
+    if (group != 0) {
+        rf12_xfer(0xCA83); // FIFO8,2-SYNC,!ff,DR 
+        rf12_xfer(0xCE00 | group); // SYNC=2DXX； 
+    } else {
+        rf12_xfer(0xCA8B); // FIFO8,1-SYNC,!ff,DR 
+        rf12_xfer(0xCE2D); // SYNC=2D； 
+    }
+    rxstate = TXIDLE;
+}
+
 /*
   Call this once with the node ID (0-31), frequency band (0-3), and
   optional group (0-255 for RF12B, only 212 allowed for RF12).
 */
 static void rf12_initialize (uint8_t id, uint8_t band, uint8_t g) {
-    nodeid = id;
-    group = g;
-		P("RF12 id="); P_X8(id); P(" b="); P_X8(band); P(" g="); P_X8(g); P_LN();
+		P("RF12 b="); P_X8(band); P_LN();
     
     spi_initialize();
 
@@ -354,13 +380,6 @@ static void rf12_initialize (uint8_t id, uint8_t band, uint8_t g) {
     rf12_xfer(0x94B2); // VDI,FAST,134kHz,-?dBm,-91dBm 
 #endif
     rf12_xfer(0xC2AC); // AL,!ml,DIG,DQD4 
-    if (group != 0) {
-        rf12_xfer(0xCA83); // FIFO8,2-SYNC,!ff,DR 
-        rf12_xfer(0xCE00 | group); // SYNC=2DXX； 
-    } else {
-        rf12_xfer(0xCA8B); // FIFO8,1-SYNC,!ff,DR 
-        rf12_xfer(0xCE2D); // SYNC=2D； 
-    }
     rf12_xfer(0xC483); // @PWR,NO RSTRIC,!st,!fi,OE,EN 
 #ifndef RF12_LOWPOWER
     rf12_xfer(0x9850); // !mp,90kHz,MAX OUT 
@@ -372,7 +391,7 @@ static void rf12_initialize (uint8_t id, uint8_t band, uint8_t g) {
     rf12_xfer(0xC800); // NOT USE 
     rf12_xfer(0xC049); // 1.66MHz,3.1V 
 
-    rxstate = TXIDLE;
+    rf12_retune(id, g);
     // if ((nodeid & NODE_ID) != 0)
     //     attachInterrupt(0, rf12_interrupt, LOW);
     // else
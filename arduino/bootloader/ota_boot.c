@@ -11,8 +11,10 @@
 #include <avr/wdt.h>
 #include <util/crc16.h>
 
-// undef->none, 1->LED Port1-D, 2->serial 57600kbps
+// 0->none, 1->LED Port1-D, 2->serial 57600kbps, can be overridden with -DDEBUG=...
+#ifndef DEBUG
 #define DEBUG 3
+#endif
 
 #define bit(b) (1 << (b))
 #define bitRead(value, bit) (((value) >> (bit)) & 0x01)
@@ -29,12 +31,48 @@ typedef uint16_t word;
 
 uint32_t hwId [4];  
 
+// The RFM12B needs at least 4 MHz to keep up with the radio, everything else
+// (CRC checks, de-whitening, flash writes) runs at full speed. Use clock_div_2
+// for CLOCK_FAST if the supply voltage can drop too low for 16 MHz operation.
+#define CLOCK_RADIO clock_div_4
+#ifndef CLOCK_FAST
+#define CLOCK_FAST clock_div_1
+#endif
+
+// The optional modes below are off by default, so that every target keeps
+// fitting its boot section, the Makefile turns them on per target. Each one
+// adds code, check the size report of a build before enabling it elsewhere.
+// 1->accept a download streamed by the server (see packet.h), 0->only pull it
+#ifndef PUSH_MODE
+#define PUSH_MODE 0
+#endif
+// 1->wait as told when the server is busy rolling out (see packet.h), 0->ignore
+#ifndef BUSY_WAIT
+#define BUSY_WAIT 0
+#endif
+// 1->accept delta updates, applied in place (see packet.h), 0->full images only
+#ifndef DELTA_MODE
+#define DELTA_MODE 0
+#endif
+// 1->join broadcast sessions, shared with other nodes (see packet.h), 0->don't
+#ifndef BCAST_MODE
+#define BCAST_MODE 0
+#endif
+// 1->decode coded broadcasts, needs BCAST_MODE and ~400 bytes of RAM, 0->don't
+#ifndef CODED_MODE
+#define CODED_MODE 0
+#endif
+
+static uint8_t clockDiv;  // current prescaler, the CPU runs at F_CPU >> clockDiv
+
 /* Timer 1 used for network time-out and for blinking LEDs */
 static void timer_init() {
   TCCR1B = _BV(CS12) | _BV(CS10);            // div 1024 -- @4Mhz=3906Hz
 }
+// do not switch clocks while a timer is running, it would change its rate
 static void timer_start(int16_t millis) {
-	TCNT1 = -(4000L * (int32_t)millis / 1024); // 4000=4Mhz/1000, 1024=clk divider
+	// (F_CPU/8000)/128 ticks per ms at full speed, shifts avoid a 32-bit divide
+	TCNT1 = -((uint32_t)millis * (F_CPU / 8000) >> (7 + clockDiv));
 	TIFR1 = _BV(TOV1);                         // clear overflow flag
 }
 
@@ -59,8 +97,24 @@ static void sleep(uint32_t ms) {
 
 #include "debug.h"
 #include "ota_RF12.h"
+
+// switch the system clock, and adjust the peripherals which depend on it
+static void setClock (clock_div_t div) {
+  clock_prescale_set(div);
+  clockDiv = div;
+  spi_setClock(div);
+#if DEBUG & 2
+  UART_SRL = div == CLOCK_RADIO ? UART_UBRR(F_CPU >> CLOCK_RADIO)
+                                : UART_UBRR(F_CPU >> CLOCK_FAST);
+#endif
+}
+
 #include "loader.h"
 
+#ifdef BENCH
+#include "bench.h"
+#else
+
 /* The main function is in init9, which removes the interrupt vector table */
 /* we don't need. It is also 'naked', which means the compiler does not    */
 /* generate any entry or exit code itself. */
@@ -76,13 +130,13 @@ int main () {
   wdt_disable();
 
 	timer_init();
+  clockDiv = clock_prescale_get(); // clkdiv/8 fuse, until we change it
 
 #if DEBUG & 2
   // init UART
   UART_SRA = _BV(U2X0); //Double speed mode USART0
   UART_SRB = _BV(RXEN0) | _BV(TXEN0);
   UART_SRC = _BV(UCSZ00) | _BV(UCSZ01);
-  UART_SRL = (uint8_t)( (4000000L + BAUD_RATE * 4L) / (BAUD_RATE * 8L) - 1 );
 #endif
 #if DEBUG & 1
   // Set LED pin as output
@@ -97,7 +151,7 @@ int main () {
   }
 
   // switch to 4 MHz, the minimum rate needed to use the RFM12B
-  clock_prescale_set(clock_div_4);
+  setClock(CLOCK_RADIO);
 
   flash_led(4); // 2 flashes
 	P("\n\nBOOT!\n");
@@ -112,3 +166,5 @@ int main () {
   for (;;)
     ;
 }
+
+#endif
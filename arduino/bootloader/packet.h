@@ -39,3 +39,86 @@ struct DownloadReply {
   uint16_t swIdXor;   // current software ID xor current download index
   uint8_t data [BOOT_DATA_MAX]; // download payload
 };
+
+// Push mode: a node which can take a streamed download appends a flags byte
+// to its UpgradeRequest, with UPGRADE_PUSH set. If the server agrees, it also
+// appends a flags byte with UPGRADE_PUSH to its UpgradeReply, and then sends
+// the DownloadReply packets without waiting for requests. The node only sends
+// DownloadRequest packets as acks: swIndex is the next chunk it needs, with
+// PUSH_HOLE set if the server should resend from there (a hole report).
+#define UPGRADE_PUSH 0x01
+#define PUSH_HOLE 0x8000
+
+struct UpgradeRequestPush {
+  struct UpgradeRequest req;
+  uint8_t flags;      // UPGRADE_PUSH and UPGRADE_BUSY, if the node handles them
+};
+
+struct UpgradeReplyPush {
+  struct UpgradeReply reply;
+  uint8_t flags;      // UPGRADE_PUSH if the server will stream the download
+};
+
+// Busy reply: a node which sets UPGRADE_BUSY in its request flags can be told
+// to come back later, when the server is rolling out to many nodes at once.
+// The reply then has the node's own swId, swSize, and swCheck, followed by
+// UPGRADE_BUSY and the number of seconds to wait before asking again.
+#define UPGRADE_BUSY 0x02
+
+struct UpgradeReplyBusy {
+  struct UpgradeReply reply;
+  uint8_t flags;      // UPGRADE_BUSY
+  uint8_t retry;      // seconds to wait before the next upgrade request
+};
+
+// Delta updates: a node whose current image is valid sets UPGRADE_DELTA in its
+// request flags. If the server has that image, it may reply with UPGRADE_DELTA
+// and the number of chunks of a list of ops, which turn the current image into
+// the new one. These chunks are then downloaded instead of the new image, in
+// the same way, and the ops are applied in place as they come in:
+//   DELTA_END                      no more ops, the rest is padding
+//   DELTA_LIT len16 bytes...       append literal bytes
+//   DELTA_COPY src16 len16         append bytes from the old image in flash
+//   DELTA_RUN value len16          append one byte value len16 times
+// Copies never read from pages before the one written last, whose old content
+// is kept in RAM. Operands are little-endian, ops may span several chunks.
+#define UPGRADE_DELTA 0x04
+
+#define DELTA_END 0
+#define DELTA_LIT 1
+#define DELTA_COPY 2
+#define DELTA_RUN 3
+
+struct UpgradeReplyDelta {
+  struct UpgradeReply reply;
+  uint8_t flags;      // UPGRADE_DELTA, plus UPGRADE_PUSH if streamed
+  uint16_t chunks;    // number of chunks with delta ops to download
+};
+
+// Broadcast sessions: a node which sets UPGRADE_BCAST in its request flags may
+// get it back in the reply flags. It then listens to the DownloadReply packets
+// the server broadcasts to the whole group, in any order, and keeps a bitmap
+// of the chunks it has. When no new chunks come in, it sends RepairRequest
+// packets for the chunks still missing, the server merges these across nodes
+// and broadcasts each of those chunks once more. There is one session per
+// group at a time, nodes which need another image get a plain reply. Chunks
+// meant for one node are sent to its address, broadcasts go without one.
+#define UPGRADE_BCAST 0x08
+
+struct RepairRequest {
+  uint16_t swId;
+  uint16_t base;      // index of the first chunk covered by missing
+  uint8_t missing [8]; // one bit per chunk, lowest bit first, set if needed
+};
+
+// Coded broadcasts: a node which also sets UPGRADE_CODED may get both flags
+// back. The server then broadcasts an endless stream of symbols instead, with
+// no repair requests. Each is sent as a DownloadReply, with its seed in place
+// of the index. Seeds below the number of chunks are the chunks themselves,
+// later ones are the xor of a few chunks, picked by a 16-bit xorshift (7,9,8)
+// started at seed ^ 0xACE1: the first value picks the degree from a table, the
+// next ones the chunks, modulo the number of chunks, skipping repeats. Which
+// symbols arrive doesn't matter, how many does: with the small decoder of the
+// boot loader, about 1.4 times as many as there are chunks at 5% packet loss,
+// 1.8 times at 20%, and 4.5 times at 50%.
+#define UPGRADE_CODED 0x10
@@ -0,0 +1,77 @@
+// Run the boot loader benchmarks (see bench.h) under simavr, and print one
+// "name cycles" line for each of them
+//
+// usage: simbench ota_boot_bench.elf
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "avr_spi.h"
+
+// data space addresses of the ATmega328's general purpose I/O registers
+#define GPIOR0 0x3E
+#define GPIOR1 0x4A
+#define GPIOR2 0x4B
+
+static const char* names[] = {
+  "calcCRC_flash_30k",    // 0: cycles per 30 KB flash CRC check
+  "writeFlash_page",      // 1: cycles per page, without the SPM busy times
+  "rf12_interrupt_byte",  // 2: cycles per received byte
+  "dewhiten_packet",      // 3: cycles per 64-byte payload
+};
+
+static avr_cycle_count_t start;
+static uint8_t reps = 1;
+static avr_irq_t* spiIn;
+
+static void benchReps (avr_t* avr, avr_io_addr_t addr, uint8_t v, void* p) {
+  reps = v ? v : 1;
+}
+
+static void benchStart (avr_t* avr, avr_io_addr_t addr, uint8_t v, void* p) {
+  start = avr->cycle;
+}
+
+static void benchStop (avr_t* avr, avr_io_addr_t addr, uint8_t v, void* p) {
+  if (v < sizeof names / sizeof *names)
+    printf("%s %llu\n", names[v],
+            (unsigned long long) (avr->cycle - start) / reps);
+}
+
+// stand-in for the RFM12B: completes every SPI transfer, always returns 0
+static void spiOut (avr_irq_t* irq, uint32_t value, void* p) {
+  avr_raise_irq(spiIn, 0);
+}
+
+int main (int argc, char** argv) {
+  elf_firmware_t f = {{0}};
+  if (argc != 2 || elf_read_firmware(argv[1], &f) != 0) {
+    fprintf(stderr, "usage: %s <bench.elf>\n", argv[0]);
+    return 1;
+  }
+
+  avr_t* avr = avr_make_mcu_by_name("atmega328p");
+  if (avr == NULL)
+    return 1;
+  avr_init(avr);
+  avr->frequency = 16000000;
+  avr_load_firmware(avr, &f);
+  avr->pc = f.flashbase; // start in the boot section, as with BOOTRST
+
+  avr_register_io_write(avr, GPIOR0, benchReps, NULL);
+  avr_register_io_write(avr, GPIOR1, benchStart, NULL);
+  avr_register_io_write(avr, GPIOR2, benchStop, NULL);
+
+  spiIn = avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_INPUT);
+  avr_irq_register_notify(
+      avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT),
+      spiOut, NULL);
+
+  int state;
+  do
+    state = avr_run(avr);
+  while (state != cpu_Done && state != cpu_Crashed);
+
+  return state == cpu_Done ? 0 : 1;
+}
@@ -0,0 +1,19 @@
+#!/bin/sh
+# report the flash size of a boot loader build, compared to its limit and to
+# the size recorded in the baseline file, fails if the limit is exceeded
+#
+# usage: size_report.sh <avr-size> <file.elf> <limit> <baseline>
+
+size=$("$1" "$2" | awk 'NR == 2 { print $1 + $2 }') # .text + .data
+base=$(awk -v f="$2" '$1 == f { print $2 }' "$4" 2>/dev/null)
+
+printf '%s %d bytes, limit %d, free %d' "$2" "$size" "$3" $(($3 - size))
+if [ -n "$base" ]; then
+  printf ', baseline %d (%+d)' "$base" $((size - base))
+fi
+echo
+
+if [ "$size" -gt "$3" ]; then
+  echo "$2 exceeds the boot section limit by $((size - $3)) bytes" >&2
+  exit 1
+fi
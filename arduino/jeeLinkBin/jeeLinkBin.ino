@@ -0,0 +1,119 @@
+/// @dir jeeLinkBin
+/// Radio gateway for the JeeBoot server, using binary frames on the serial port.
+// 2026-10-19 <agent@local> http://opensource.org/licenses/mit-license.php
+//
+// Each frame is: 0xA5, length, type, payload..., crc-lo, crc-hi
+// The length counts the type and payload bytes, the crc covers length, type,
+// and payload, using the same CRC-16 as the boot loader (_crc16_update).
+//
+// Frames from the server:
+//   'C' band group nodeId       (re-)initialize the radio, group 0 = all
+//   'S' group hdr payload...    send a packet, hdr as in rf12_sendStart, on the
+//                               given group, 0 for the one set up with 'C'
+// Frames to the server:
+//   'H' version 0               hello, sent on startup
+//   'R' group hdr payload...    a packet received with a valid crc
+
+#include <JeeLib.h>
+#include <util/crc16.h>
+
+#define BAUD 500000   // 16 MHz / 500000 = 32, no error, and a standard B500000 rate
+#define VERSION 2
+
+#define FRAME_START 0xA5
+#define FRAME_MAX (RF12_MAXDATA + 3) // length of a send frame: type, group, hdr
+
+static byte inBuf [1 + FRAME_MAX];  // length, type, payload, of frame being read
+static byte inFill;                 // bytes in inBuf, 0 while looking for start
+static word inCrc;
+static byte band = RF12_868MHZ, group = 212, nodeId = 31; // 0 = all groups
+
+static void sendFrame (byte type, byte a, byte b, const volatile byte* ptr, byte len) {
+  byte n = 3 + len;
+  word crc = ~0;
+  Serial.write(FRAME_START);
+  Serial.write(n);
+  crc = _crc16_update(crc, n);
+  Serial.write(type);
+  crc = _crc16_update(crc, type);
+  Serial.write(a);
+  crc = _crc16_update(crc, a);
+  Serial.write(b);
+  crc = _crc16_update(crc, b);
+  for (byte i = 0; i < len; ++i) {
+    Serial.write(ptr[i]);
+    crc = _crc16_update(crc, ptr[i]);
+  }
+  Serial.write((byte) crc);
+  Serial.write((byte) (crc >> 8));
+}
+
+static void handleFrame (byte type, const byte* data, byte len) {
+  switch (type) {
+    case 'C':
+      if (len >= 3) {
+        band = data[0];
+        group = data[1];
+        nodeId = data[2];
+        rf12_initialize(nodeId, band, group);
+      }
+      break;
+    case 'S':
+      if (len >= 2) {
+        while (!rf12_canSend())
+          rf12_recvDone();
+        // listening on all groups sends on group 0, which no node hears:
+        // switch to the node's group for this one packet
+        byte other = group == 0 && data[0] != 0;
+        if (other)
+          rf12_initialize(nodeId, band, data[0]);
+        rf12_sendStart(data[1], data + 2, len - 2);
+        if (other) {
+          rf12_sendWait(0);
+          rf12_initialize(nodeId, band, 0);
+        }
+      }
+      break;
+  }
+}
+
+// collect incoming bytes, re-synchronize on the next start byte after errors
+static void readSerial () {
+  while (Serial.available()) {
+    byte b = Serial.read();
+    if (inFill == 0) {
+      if (b == FRAME_START) {
+        inFill = 1;
+        inCrc = ~0;
+      }
+      continue;
+    }
+    if (inFill == 1 && (b < 1 || b > FRAME_MAX)) {
+      inFill = 0; // bad length
+      continue;
+    }
+    byte n = inFill == 1 ? b : inBuf[0];
+    inCrc = _crc16_update(inCrc, b);
+    if (inFill - 1 < sizeof inBuf)
+      inBuf[inFill - 1] = b;
+    if (++inFill == n + 4) { // start, length, n bytes, and 2 crc bytes read
+      // running the crc over its own bytes as well leaves a zero residue
+      if (inCrc == 0)
+        handleFrame(inBuf[1], inBuf + 2, n - 1);
+      inFill = 0;
+    }
+  }
+}
+
+void setup () {
+  Serial.begin(BAUD);
+  rf12_initialize(nodeId, band, group);
+  byte version = VERSION;
+  sendFrame('H', version, 0, 0, 0);
+}
+
+void loop () {
+  readSerial();
+  if (rf12_recvDone() && rf12_crc == 0)
+    sendFrame('R', rf12_grp, rf12_hdr, rf12_data, rf12_len);
+}
@@ -0,0 +1,298 @@
+package jeeboot
+
+import (
+	"fmt"
+	"io"
+	"sort"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/jcw/flow"
+)
+
+func init() {
+	flow.Registry["Airtime"] = func() flow.Circuitry { return &Airtime{} }
+}
+
+const (
+	rf12Bitrate  = 49230 // bits per second, as set up by RF12demo
+	rf12Overhead = 10    // preamble, sync, group, hdr, len, crc, and tail bytes
+
+	// replyWindow is how long the bootloader waits for a reply, by default,
+	// anything which can't be sent out before then is dropped: it will retry
+	replyWindow = 250 * time.Millisecond
+
+	// budgetWindow is the burst of airtime allowed, as a fraction of an hour
+	budgetWindow = time.Minute
+)
+
+// dutyCycle returns the fraction of time a gateway may transmit in a band.
+func dutyCycle(band int) float64 {
+	switch band {
+	case 433:
+		return 0.10
+	case 868:
+		return 0.01
+	}
+	return 1 // no duty cycle limit, e.g. 915 MHz
+}
+
+// airtimeOf returns how long an RF12demo send command such as "1,2,3,81s"
+// keeps the transmitter on. All but the last value are payload bytes.
+func airtimeOf(cmd string) time.Duration {
+	n := strings.Count(cmd, ",") + rf12Overhead
+	return time.Duration(n*8) * time.Second / rf12Bitrate
+}
+
+// Transmit classes, in order of priority.
+const (
+	txControl = iota // pairing and upgrade replies, short and urgent
+	txBulk           // download chunks
+	txClasses
+)
+
+var txClassNames = [txClasses]string{"control", "bulk"}
+
+// isBulk returns true for the send commands of download chunks, as opposed to
+// control replies such as pairing, upgrade, and busy replies.
+func isBulk(cmd string) bool {
+	return strings.Count(cmd, ",") >= 64
+}
+
+type txPending struct {
+	cmd      string
+	airtime  time.Duration
+	deadline time.Time // when the node stops waiting for this reply
+	group    int       // net group to send it on, 0 for the radio's own
+}
+
+// txScheduler queues the radio commands of one gateway, and releases them
+// as the airtime budget allows. The budget is a token bucket, refilled at the
+// duty cycle rate. Its burst plus refill never exceeds the duty cycle over an
+// hour, so the legal limit also holds for any sliding one-hour window.
+type txScheduler struct {
+	rate   float64 // seconds of airtime earned per second
+	burst  float64 // maximum seconds of airtime in the bucket
+	bucket float64 // seconds of airtime available right now
+	last   time.Time
+	queues [txClasses][]txPending
+	stats  *txStats
+}
+
+func newTxScheduler(band int, now time.Time) *txScheduler {
+	duty := dutyCycle(band)
+	burst := duty * budgetWindow.Seconds()
+	return &txScheduler{
+		rate:   duty * (time.Hour - budgetWindow).Seconds() / time.Hour.Seconds(),
+		burst:  burst,
+		bucket: burst,
+		last:   now,
+		stats:  txStatsFor(band),
+	}
+}
+
+// push queues a command, download chunks go behind all control replies.
+// Without a deadline, the command must go out within the default window.
+func (s *txScheduler) push(cmd string, group int, now, deadline time.Time) {
+	if deadline.IsZero() {
+		deadline = now.Add(replyWindow)
+	}
+	class := txControl
+	if isBulk(cmd) {
+		class = txBulk
+	}
+	s.queues[class] = append(s.queues[class],
+		txPending{cmd, airtimeOf(cmd), deadline, group})
+}
+
+// pending returns the number of queued commands.
+func (s *txScheduler) pending() int {
+	return len(s.queues[txControl]) + len(s.queues[txBulk])
+}
+
+// next returns the next command which may go out now. If there is none, its
+// cmd is empty, and it returns how long to wait before trying again, or 0 if
+// nothing is queued. Commands which can't go out before their deadline are
+// dropped.
+func (s *txScheduler) next(now time.Time) (txPending, time.Duration) {
+	s.bucket += now.Sub(s.last).Seconds() * s.rate
+	if s.bucket > s.burst {
+		s.bucket = s.burst
+	}
+	s.last = now
+
+	for class := range s.queues {
+		q := s.queues[class]
+		for len(q) > 0 {
+			p := q[0]
+			wait := s.waitFor(p.airtime)
+			if !now.Add(wait).After(p.deadline) {
+				if wait > 0 {
+					s.queues[class] = q
+					return txPending{}, wait
+				}
+				s.queues[class] = q[1:]
+				s.bucket -= p.airtime.Seconds()
+				s.stats.countSent(class, p.airtime)
+				return p, 0
+			}
+			q = q[1:]
+			s.stats.countDropped(class)
+		}
+		s.queues[class] = q
+	}
+	return txPending{}, 0
+}
+
+// waitFor returns how long until the bucket holds the given airtime.
+func (s *txScheduler) waitFor(airtime time.Duration) time.Duration {
+	short := airtime.Seconds() - s.bucket
+	if short <= 0 {
+		return 0
+	}
+	return time.Duration(short/s.rate*1e9) + 1
+}
+
+// txStats counts the airtime used and commands sent or dropped in one band.
+type txStats struct {
+	mu      sync.Mutex
+	airtime time.Duration
+	sent    [txClasses]int
+	dropped [txClasses]int
+}
+
+var (
+	txStatsMu sync.Mutex
+	txBands   = map[int]*txStats{}
+)
+
+// txStatsFor returns the counters of a band, shared by all its gateways.
+func txStatsFor(band int) *txStats {
+	txStatsMu.Lock()
+	defer txStatsMu.Unlock()
+	st := txBands[band]
+	if st == nil {
+		st = &txStats{}
+		txBands[band] = st
+	}
+	return st
+}
+
+func (st *txStats) countSent(class int, airtime time.Duration) {
+	st.mu.Lock()
+	st.airtime += airtime
+	st.sent[class]++
+	st.mu.Unlock()
+}
+
+func (st *txStats) countDropped(class int) {
+	st.mu.Lock()
+	st.dropped[class]++
+	st.mu.Unlock()
+}
+
+// writeTxMetrics writes the airtime counters of all bands, Prometheus style.
+func writeTxMetrics(w io.Writer) {
+	txStatsMu.Lock()
+	bands := make([]int, 0, len(txBands))
+	for band := range txBands {
+		bands = append(bands, band)
+	}
+	txStatsMu.Unlock()
+	sort.Ints(bands)
+
+	fmt.Fprintf(w, "# HELP jeeboot_airtime_seconds_total Time spent transmitting.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_airtime_seconds_total counter\n")
+	for _, band := range bands {
+		st := txStatsFor(band)
+		st.mu.Lock()
+		fmt.Fprintf(w, "jeeboot_airtime_seconds_total{band=\"%d\"} %g\n",
+			band, st.airtime.Seconds())
+		st.mu.Unlock()
+	}
+	for _, kind := range []string{"sent", "dropped"} {
+		fmt.Fprintf(w, "# HELP jeeboot_tx_%s_total Radio replies %s.\n", kind, kind)
+		fmt.Fprintf(w, "# TYPE jeeboot_tx_%s_total counter\n", kind)
+		for _, band := range bands {
+			st := txStatsFor(band)
+			st.mu.Lock()
+			counts := st.sent
+			if kind == "dropped" {
+				counts = st.dropped
+			}
+			st.mu.Unlock()
+			for class, n := range counts {
+				fmt.Fprintf(w, "jeeboot_tx_%s_total{band=\"%d\",class=\"%s\"} %d\n",
+					kind, band, txClassNames[class], n)
+			}
+		}
+	}
+}
+
+// Airtime sits between JeeBoot and the serial port of one gateway, and keeps
+// its radio within the duty cycle of the band fed in on Band (in MHz, default
+// 868). Control replies go out before download chunks, replies which can't
+// legally go out before their "<deadline>" tag are dropped. The tag is passed
+// on in front of each command sent, as is the "<group>" tag of commands which
+// have one. Anything else is passed on right away.
+type Airtime struct {
+	flow.Gadget
+	In   flow.Input
+	Band flow.Input
+	Out  flow.Output
+}
+
+// Start scheduling, this ends once the input is closed and all is sent.
+func (g *Airtime) Run() {
+	band := 868
+	if m, ok := <-g.Band; ok {
+		band = m.(int)
+	}
+	s := newTxScheduler(band, time.Now())
+
+	in := g.In
+	var wake <-chan time.Time
+	var deadline time.Time // of the next command
+	var group int          // of the next command
+	for in != nil || s.pending() > 0 {
+		select {
+		case m, ok := <-in:
+			if !ok {
+				in = nil
+				continue
+			}
+			if t, ok := m.(flow.Tag); ok && t.Tag == "<deadline>" {
+				deadline = t.Msg.(time.Time)
+				continue
+			}
+			if t, ok := m.(flow.Tag); ok && t.Tag == "<group>" {
+				group = t.Msg.(int)
+				continue
+			}
+			cmd, ok := m.(string)
+			if !ok || !strings.HasSuffix(cmd, "s") {
+				g.Out.Send(m)
+				continue
+			}
+			s.push(cmd, group, time.Now(), deadline)
+			deadline, group = time.Time{}, 0
+		case <-wake:
+		}
+		wake = nil
+		for {
+			p, wait := s.next(time.Now())
+			if p.cmd == "" {
+				if wait > 0 {
+					wake = time.After(wait)
+				}
+				break
+			}
+			if p.group != 0 {
+				g.Out.Send(groupTag(p.group))
+			}
+			g.Out.Send(deadlineTag(p.deadline))
+			g.Out.Send(p.cmd)
+		}
+	}
+}
@@ -0,0 +1,258 @@
+package jeeboot
+
+import (
+	"fmt"
+	"io"
+	"sync/atomic"
+	"time"
+)
+
+// Broadcast sessions: when several nodes in a group need the same image, it
+// is sent once to all of them. A node which can take part sets upgradeBcast
+// in its upgrade request flags. If the config sets "broadcast", i.e. the
+// number of ms between chunks, the reply gets the same flag appended, and the
+// node joins the session for its group and image, starting one if needed.
+// There is only one session per group at a time: the chunks only carry the
+// image's swId xor-ed with their index, which can't tell two images apart, so
+// nodes which need another image download it on their own. This includes a
+// new image for the same swId, loaded while a session is running: the session
+// keeps sending the image its nodes started with, until it ends.
+// The server sends every chunk once, as broadcast, and nodes joining later
+// pick up the rest of the round. Each node marks the chunks it received in a
+// bitmap, and then sends repair requests with the bits of the chunks it still
+// needs. These are merged across all nodes, so that each missing chunk is
+// only sent once more, as broadcast again. Deltas take precedence, they are
+// still sent to each node separately. See coded.go for sessions without
+// repairs.
+const (
+	upgradeBcast = 0x08             // flag byte: broadcast understood / used
+	bcastIdle    = 10 * time.Second // a session ends without chunks to send
+)
+
+// bcastKey identifies a broadcast session, there's at most one per group.
+type bcastKey struct {
+	group uint8
+	swID  uint16
+	coded bool
+}
+
+func (k bcastKey) String() string {
+	return fmt.Sprintf("b:%d/%d", k.group, k.swID)
+}
+
+// bcastSession is the state of one broadcast session.
+type bcastSession struct {
+	fw       *firmware
+	pending  []bool // chunks still to send
+	nPending int
+	next     int       // where to look for the next pending chunk
+	last     time.Time // last chunk sent, or session started
+
+	seed uint16 // next symbol to send, in a coded session
+	left int    // symbols still to send, in a coded session
+}
+
+type repairRequest struct {
+	SwID    uint16   // software ID being broadcast
+	Base    uint16   // index of the first chunk in Missing
+	Missing [8]uint8 // one bit per chunk, set if it's still needed
+}
+
+func (r *repairRequest) decode(b []byte) {
+	r.SwID = get16(b[0:])
+	r.Base = get16(b[2:])
+	copy(r.Missing[:], b[4:12])
+}
+
+// bcastInterval returns the time between broadcast chunks, 0 if broadcast
+// sessions are disabled.
+func (c *config) bcastInterval() time.Duration {
+	return time.Duration(c.Broadcast * float64(time.Millisecond))
+}
+
+// joinBroadcast returns true if a node can join a session for fw in its
+// group. Only the node starting a session needs a download slot, the others
+// don't add to the airtime used.
+func (w *JeeBoot) joinBroadcast(group uint8, swID uint16, fw *firmware,
+	coded bool) bool {
+	s := w.bcasts[bcastKey{group, swID, coded}]
+	return s != nil && s.fw == fw
+}
+
+// bcastFree returns true if the group has no broadcast session, other than
+// the one with this key which sends fw.
+func (w *JeeBoot) bcastFree(key bcastKey, fw *firmware) bool {
+	for k, s := range w.bcasts {
+		if k.group == key.group && (k != key || s.fw != fw) {
+			return false
+		}
+	}
+	return true
+}
+
+// startBroadcast starts a session which sends all chunks of fw to a group. A
+// coded session which is already running is extended instead, so that it
+// lasts until codedSpan rounds after the last node joined. A session for
+// another image is left alone, see bcastFree.
+func (w *JeeBoot) startBroadcast(group uint8, swID uint16, fw *firmware,
+	coded bool, now time.Time) {
+	key := bcastKey{group, swID, coded}
+	s := w.bcasts[key]
+	if s != nil && s.fw != fw {
+		return
+	}
+	if coded {
+		// the nodes won't ask for it after a restart, the journal has to
+		bootState.put(journalEntry{Key: key.String(),
+			Bcast: &bcastRecord{group, swID, fw.crc, now}})
+	}
+	if s != nil {
+		if coded {
+			s.left = codedSpan * len(fw.chunks)
+		}
+		return
+	}
+	if w.bcasts == nil {
+		w.bcasts = map[bcastKey]*bcastSession{}
+	}
+	s = &bcastSession{fw: fw, last: now}
+	if coded {
+		s.left = codedSpan * len(fw.chunks)
+	} else {
+		s.pending = make([]bool, len(fw.chunks))
+		s.nPending = len(fw.chunks)
+		for i := range s.pending {
+			s.pending[i] = true
+		}
+	}
+	w.bcasts[key] = s
+}
+
+// repairBroadcast merges the chunks a node still needs into its session. If
+// the session is over, or was lost in a restart, a new one is started for
+// these chunks. Repairs for any other image than the one the node started
+// with are ignored.
+func (w *JeeBoot) repairBroadcast(cfg *nodeConfig, node nodeKey,
+	req *repairRequest, now time.Time) {
+	fw := sessions.pinned(cfg, node, req.SwID)
+	if fw == nil {
+		return // the node will start over with a normal download
+	}
+	key := bcastKey{node.group, req.SwID, false}
+	s := w.bcasts[key]
+	if s != nil && s.fw != fw {
+		return
+	}
+	if s == nil {
+		if cfg.bcastInterval() <= 0 || !w.bcastFree(key, fw) {
+			return
+		}
+		w.startBroadcast(node.group, req.SwID, fw, false, now)
+		s = w.bcasts[key]
+		for i := range s.pending {
+			s.pending[i] = false
+		}
+		s.nPending = 0
+	}
+	atomic.AddUint64(&bcastCounts.repairs, 1)
+	for i := 0; i < 8*len(req.Missing); i++ {
+		index := int(req.Base) + i
+		if req.Missing[i/8]&(1<<uint(i%8)) != 0 && index < len(s.pending) &&
+			!s.pending[index] {
+			s.pending[index] = true
+			s.nPending++
+		}
+	}
+}
+
+// bcastTicker returns the channel which paces all broadcast sessions, or nil
+// if there are none.
+func (w *JeeBoot) bcastTicker() <-chan time.Time {
+	cfg := bootConfig.get()
+	interval := cfg.bcastInterval()
+	if interval <= 0 {
+		w.bcasts = nil // broadcast sessions were turned off
+	} else if cfg.Coded {
+		w.resumeBroadcasts(cfg, time.Now())
+	}
+	return runTicker(&w.bcastTick, len(w.bcasts) > 0, interval)
+}
+
+// resumeBroadcasts restarts the coded broadcasts from the journal in the
+// groups this gadget listens to, once their images have been loaded.
+func (w *JeeBoot) resumeBroadcasts(cfg *nodeConfig, now time.Time) {
+	var later []bcastRecord
+	for _, r := range bootState.takeBroadcasts(w.listensTo) {
+		switch fw := cfg.GetFirmware(r.SwID); {
+		case fw == nil:
+			later = append(later, r)
+		case fw.crc == r.Crc && w.bcastFree(bcastKey{r.Group, r.SwID, true}, fw):
+			w.startBroadcast(r.Group, r.SwID, fw, true, now)
+		}
+	}
+	bootState.returnBroadcasts(later)
+}
+
+// broadcastChunks sends the next pending chunk of each session, in index
+// order, or the next symbol of each coded session, and ends the sessions
+// which have had nothing to send for a while.
+func (w *JeeBoot) broadcastChunks(now time.Time) {
+	buf := cmdBuffers.Get().(*[]byte)
+	for key, s := range w.bcasts {
+		if s.nPending == 0 && s.left == 0 {
+			if now.Sub(s.last) > bcastIdle {
+				delete(w.bcasts, key)
+				if key.coded {
+					bootState.put(journalEntry{Key: key.String()})
+				}
+			}
+			continue
+		}
+		var index uint16
+		var cmd []byte
+		if key.coded {
+			index = s.seed
+			s.seed++
+			s.left--
+			cmd = s.fw.appendSymbolCmd((*buf)[:0], key.swID, index)
+			atomic.AddUint64(&bcastCounts.symbols, 1)
+		} else {
+			for !s.pending[s.next] {
+				s.next = (s.next + 1) % len(s.pending)
+			}
+			index = uint16(s.next)
+			s.pending[s.next] = false
+			s.nPending--
+			cmd = s.fw.appendDownloadCmd((*buf)[:0], key.swID, index, 0)
+			atomic.AddUint64(&bcastCounts.chunks, 1)
+		}
+		s.last = now
+		w.sendCmd(key.group, now.Add(replyWindow), string(cmd))
+		*buf = cmd
+		if sampleChunk(index, len(s.fw.chunks)) {
+			bootLog.add(1, logEvent{kind: logDownload, group: key.group,
+				swID: key.swID, index: index})
+		}
+	}
+	cmdBuffers.Put(buf)
+}
+
+// bcastCounts counts the broadcast traffic, in all JeeBoot gadgets.
+var bcastCounts struct {
+	chunks  uint64 // chunks sent as broadcast
+	symbols uint64 // coded symbols sent
+	repairs uint64 // repair requests received
+}
+
+// writeBcastMetrics writes the broadcast counters, Prometheus style.
+func writeBcastMetrics(w io.Writer) {
+	fmt.Fprintf(w, "# HELP jeeboot_broadcast_chunks_total Chunks sent to all nodes at once.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_broadcast_chunks_total counter\n")
+	fmt.Fprintf(w, "jeeboot_broadcast_chunks_total %d\n", atomic.LoadUint64(&bcastCounts.chunks))
+	fmt.Fprintf(w, "# HELP jeeboot_broadcast_symbols_total Coded symbols sent to all nodes at once.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_broadcast_symbols_total counter\n")
+	fmt.Fprintf(w, "jeeboot_broadcast_symbols_total %d\n", atomic.LoadUint64(&bcastCounts.symbols))
+	fmt.Fprintf(w, "# HELP jeeboot_broadcast_repairs_total Repair requests merged.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_broadcast_repairs_total counter\n")
+	fmt.Fprintf(w, "jeeboot_broadcast_repairs_total %d\n", atomic.LoadUint64(&bcastCounts.repairs))
+}
@@ -0,0 +1,85 @@
+package jeeboot
+
+import (
+	"crypto/sha256"
+	"fmt"
+	"io"
+	"strconv"
+	"sync"
+)
+
+// Firmware images are stored as chunks of 64 bytes, the download payload size,
+// and each chunk is stored only once, keyed by the SHA-256 of its content.
+// Versions of a sketch share most of their chunks (runtime, vector table,
+// libraries), so memory use scales with the unique content of all images, and
+// a new version only needs to encode the chunks which haven't been seen yet.
+// The whitening only depends on the offset within a chunk, not on its index,
+// so the encoded reply text can be shared as well.
+
+// chunkSize is the payload size of a download reply.
+const chunkSize = 64
+
+// chunk is the content of one download reply, it never changes.
+type chunk struct {
+	data  [chunkSize]byte
+	frame string // whitened payload, as RF12demo text
+	refs  int    // number of images using it, guarded by chunkStore.mu
+}
+
+// chunkTable holds all chunks in use by the loaded images.
+type chunkTable struct {
+	mu sync.Mutex
+	m  map[[sha256.Size]byte]*chunk
+}
+
+// chunkStore is shared by all firmware images.
+var chunkStore = &chunkTable{m: map[[sha256.Size]byte]*chunk{}}
+
+// intern returns the shared chunk with this content, and whether it is new.
+func (t *chunkTable) intern(data []byte) (*chunk, bool) {
+	sum := sha256.Sum256(data)
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	if c := t.m[sum]; c != nil {
+		c.refs++
+		return c, false
+	}
+	c := &chunk{refs: 1}
+	copy(c.data[:], data)
+	buf := make([]byte, 0, 4*chunkSize)
+	for j, v := range c.data {
+		buf = append(buf, ',')
+		buf = strconv.AppendUint(buf, uint64(v^uint8(211*j)), 10)
+	}
+	c.frame = string(buf)
+	t.m[sum] = c
+	return c, true
+}
+
+// release drops the references of an image which is no longer loaded. Its
+// chunks stay valid for downloads still using it, they're just not shared.
+func (t *chunkTable) release(chunks []*chunk) {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	for _, c := range chunks {
+		if c.refs--; c.refs == 0 {
+			delete(t.m, sha256.Sum256(c.data[:]))
+		}
+	}
+}
+
+// writeMetrics writes the number of unique and referenced chunks, Prometheus style.
+func (t *chunkTable) writeMetrics(w io.Writer) {
+	t.mu.Lock()
+	unique, refs := len(t.m), 0
+	for _, c := range t.m {
+		refs += c.refs
+	}
+	t.mu.Unlock()
+	fmt.Fprintf(w, "# HELP jeeboot_chunks_unique Distinct chunks stored, in all images.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_chunks_unique gauge\n")
+	fmt.Fprintf(w, "jeeboot_chunks_unique %d\n", unique)
+	fmt.Fprintf(w, "# HELP jeeboot_chunks_used Chunks in all images, shared ones counted each time.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_chunks_used gauge\n")
+	fmt.Fprintf(w, "jeeboot_chunks_used %d\n", refs)
+}
@@ -0,0 +1,72 @@
+package jeeboot
+
+import "strconv"
+
+// Hand-written encoding and decoding of the fixed-layout JeeBoot packets, all
+// of them little-endian. These replace encoding/binary on the request path,
+// which uses reflection and allocates on every packet.
+
+func get16(b []byte) uint16 {
+	return uint16(b[0]) | uint16(b[1])<<8
+}
+
+func append16(b []byte, v uint16) []byte {
+	return append(b, byte(v), byte(v>>8))
+}
+
+func (r *pairingRequest) decode(b []byte) {
+	r.Variant, r.Board, r.Group, r.NodeID = b[0], b[1], b[2], b[3]
+	r.Check = get16(b[4:])
+	copy(r.HwID[:], b[6:22])
+}
+
+func (r *upgradeRequest) decode(b []byte) {
+	r.Variant, r.Board = b[0], b[1]
+	r.SwID = get16(b[2:])
+	r.SwSize = get16(b[4:])
+	r.SwCheck = get16(b[6:])
+}
+
+func (r *downloadRequest) decode(b []byte) {
+	r.SwID = get16(b[0:])
+	r.SwIndex = get16(b[2:])
+}
+
+func (r *pairingAssign) appendTo(b []byte) []byte {
+	b = append(b, r.Variant, r.Board)
+	return append(b, r.HwID[:]...)
+}
+
+func (r *pairingReply) appendTo(b []byte) []byte {
+	b = append(b, r.Variant, r.Board, r.Group, r.NodeID)
+	return append(b, r.ShKey[:]...)
+}
+
+func (r *upgradeReply) appendTo(b []byte) []byte {
+	b = append(b, r.Variant, r.Board)
+	b = append16(b, r.SwID)
+	b = append16(b, r.SwSize)
+	return append16(b, r.SwCheck)
+}
+
+// hdrDst is the RF12 header bit to address a packet to one node.
+const hdrDst = 0x40
+
+// appendCmd appends a payload as RF12demo send command, i.e. "1,2,3,81s".
+// The dst header is either hdrDst plus a node ID, or 0 to broadcast.
+func appendCmd(cmd, payload []byte, dst uint8) []byte {
+	for i, v := range payload {
+		if i > 0 {
+			cmd = append(cmd, ',')
+		}
+		cmd = strconv.AppendUint(cmd, uint64(v), 10)
+	}
+	return appendSend(cmd, dst)
+}
+
+// appendSend appends the RF12demo send command for the given dst header.
+func appendSend(cmd []byte, dst uint8) []byte {
+	cmd = append(cmd, ',')
+	cmd = strconv.AppendUint(cmd, uint64(dst), 10)
+	return append(cmd, 's')
+}
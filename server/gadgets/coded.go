@@ -0,0 +1,96 @@
+package jeeboot
+
+// Coded broadcasts: on lossy links, a plain broadcast session spends most of
+// its time on repairs. If the config sets "coded", nodes which set upgradeCoded
+// in their upgrade request flags join a broadcast session which sends an
+// endless stream of symbols instead, each the xor of a few chunks (an LT
+// code). A node decodes the image from whichever symbols it receives, without
+// any repair requests, once it has enough of them: see ltCdf for how many. The
+// code is systematic: the first symbols are the chunks themselves, so that
+// nodes on a good link finish after a single round. A session sends codedSpan
+// symbols per chunk after the last node joined, enough for up to about 40%
+// loss, nodes on worse links run out of symbols, and join again.
+//
+// Each symbol is sent as a download reply, with its seed instead of its index.
+// The seed determines which chunks are in it, through ltNeighbors, which the
+// boot loader implements in exactly the same way. The degree distribution is
+// fixed, so that the node can look it up in a small table.
+const (
+	upgradeCoded = 0x10 // flag byte: coded broadcast understood / used
+	codedSpan    = 4    // symbols sent per chunk, after the last node joined
+	ltMaxDegree  = 30   // largest number of chunks in one symbol
+)
+
+// ltCdf holds the cumulative probabilities, out of 65536, of the degrees in
+// ltDegree. This must match the tables in the boot loader. The mix is a
+// compromise: low degrees help nodes which missed many chunks, high degrees
+// those which only missed a few. The boot loader only has RAM for 32 pending
+// symbols, i.e. ones with more than one chunk still missing, and drops any
+// more, so a node needs about 1.4 times as many symbols as chunks at 5% packet
+// loss, 1.8 times at 20%, and 4.5 times at 50%, far from the few percent more
+// of an LT decoder which keeps all its symbols.
+var (
+	ltCdf    = [...]uint16{13107, 19660, 26214, 36044, 45875, 55705, 65535}
+	ltDegree = [...]uint8{2, 3, 4, 6, 10, 18, 30}
+)
+
+// ltRand is a 16-bit xorshift generator, which never returns 0.
+type ltRand uint16
+
+func (r *ltRand) next() uint16 {
+	x := uint16(*r)
+	x ^= x << 7
+	x ^= x >> 9
+	x ^= x << 8
+	*r = ltRand(x)
+	return x
+}
+
+// ltNeighbors appends the indices of the chunks xor-ed into the symbol with
+// this seed, for an image of k chunks.
+func ltNeighbors(seed uint16, k int, buf []uint16) []uint16 {
+	if int(seed) < k {
+		return append(buf, seed)
+	}
+	r := ltRand(seed ^ 0xACE1)
+	if r == 0 {
+		r = 1
+	}
+	p, i := r.next(), 0
+	for i < len(ltCdf)-1 && p >= ltCdf[i] {
+		i++
+	}
+	d := int(ltDegree[i])
+	if d > k {
+		d = k
+	}
+	start := len(buf)
+	for len(buf)-start < d {
+		c := r.next() % uint16(k)
+		dup := false
+		for _, v := range buf[start:] {
+			dup = dup || v == c
+		}
+		if !dup {
+			buf = append(buf, c)
+		}
+	}
+	return buf
+}
+
+// appendSymbolCmd appends the command to broadcast the symbol with this seed.
+func (fw *firmware) appendSymbolCmd(cmd []byte, swID, seed uint16) []byte {
+	var neighbors [ltMaxDegree]uint16
+	var payload [2 + chunkSize]byte
+	data := payload[2:]
+	for _, c := range ltNeighbors(seed, len(fw.chunks), neighbors[:0]) {
+		for j, v := range fw.chunks[c].data {
+			data[j] ^= v
+		}
+	}
+	for j := range data {
+		data[j] ^= uint8(211 * j) // whitened, same as the chunks
+	}
+	append16(payload[:0], swID^seed)
+	return appendCmd(cmd, payload[:], 0)
+}
@@ -0,0 +1,99 @@
+package jeeboot
+
+import (
+	"fmt"
+	"io"
+	"strconv"
+	"sync/atomic"
+	"time"
+
+	"github.com/jcw/flow"
+)
+
+// arrivalQueue is the number of requests StampArrival holds while JeeBoot is
+// busy, any more and the serial port gadgets wait, as they would without it.
+const arrivalQueue = 64
+
+func init() {
+	flow.Registry["StampArrival"] = func() flow.Circuitry { return &StampArrival{} }
+}
+
+// StampArrival sends an "<arrival>" tag ahead of each request. Its input is
+// read as soon as it comes in, so that requests which queue up in front of a
+// busy JeeBoot gadget keep the time they arrived, and are seen to be stale.
+type StampArrival struct {
+	flow.Gadget
+	In  flow.Input
+	Out flow.Output
+}
+
+// Stamp the requests on one goroutine, pass them on from another.
+func (g *StampArrival) Run() {
+	queue := make(chan flow.Message, arrivalQueue)
+	go func() {
+		for m := range g.In {
+			if _, ok := m.([]byte); ok {
+				queue <- arrivalTag(time.Now())
+			}
+			queue <- m
+		}
+		close(queue)
+	}()
+	for m := range queue {
+		g.Out.Send(m)
+	}
+}
+
+// arrivalTag returns the tag which announces the arrival time of the next
+// request.
+func arrivalTag(arrival time.Time) flow.Tag {
+	return flow.Tag{Tag: "<arrival>", Msg: arrival}
+}
+
+// Each request is stamped with the time it came in from the serial port, by
+// JeeLinkBin, or for RF12demo gateways by StampArrival right after decoding. A
+// node only waits so long for its reply, after which it sends a new request.
+// JeeBoot sends a "<deadline>" tag ahead of each reply, and every stage after
+// it drops replies which can no longer make it in time, instead of spending
+// airtime on them. The window defaults to replyWindow, the config can set it
+// per board type, in milliseconds, i.e. "windows": { "2": 200 }.
+
+// parseWindows converts the Windows config once, into a table per board type.
+func (c *config) parseWindows() {
+	for i := range c.windows {
+		c.windows[i] = replyWindow
+	}
+	for k, v := range c.Windows {
+		if board, err := strconv.Atoi(k); err == nil && board >= 0 && board < 256 {
+			c.windows[board] = time.Duration(v * float64(time.Millisecond))
+		}
+	}
+}
+
+// replyWindow returns how long a node of the given board type waits for a
+// reply. This is the default window if the config has not been parsed.
+func (c *config) replyWindow(board uint8) time.Duration {
+	if w := c.windows[board]; w > 0 {
+		return w
+	}
+	return replyWindow
+}
+
+// deadlineTag returns the tag which announces the deadline of the next reply.
+func deadlineTag(deadline time.Time) flow.Tag {
+	return flow.Tag{Tag: "<deadline>", Msg: deadline}
+}
+
+// staleReplies counts the replies JeeBoot dropped, per board type.
+var staleReplies [256]uint64
+
+// writeStaleMetrics writes the counts of all board types seen, Prometheus style.
+func writeStaleMetrics(w io.Writer) {
+	fmt.Fprintf(w, "# HELP jeeboot_stale_replies_total Replies dropped, too late for the node.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_stale_replies_total counter\n")
+	for board := range staleReplies {
+		if n := atomic.LoadUint64(&staleReplies[board]); n > 0 {
+			fmt.Fprintf(w, "jeeboot_stale_replies_total{board=\"%d\"} %d\n", board, n)
+		}
+	}
+}
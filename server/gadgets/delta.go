@@ -0,0 +1,152 @@
+package jeeboot
+
+import "sync"
+
+// Delta updates: a node with a valid image sets upgradeDelta in its upgrade
+// request flags. If the server has the image the node reports, it sends a
+// list of ops which turns that image into the new one, instead of the new
+// image itself. The ops are downloaded as if they were an image, chunk by
+// chunk, and the node applies them as they come in, see packet.h:
+//
+//	deltaEnd                       no more ops, the rest is padding
+//	deltaLit  len16 bytes...       insert literal bytes
+//	deltaCopy src16 len16          copy bytes from the old image in flash
+//	deltaRun  value len16          repeat one byte value
+//
+// The new image is written over the old one, one flash page at a time. The
+// boot loader keeps the old content of the page it wrote last, so that code
+// which moved down a little can still be copied, but a copy must never read
+// from any page before that one: for each byte, the source offset must be at
+// or after the start of the flash page being written, minus one page. Pages
+// are deltaPage bytes here, the smallest page size of all supported boards,
+// which is the strictest case.
+const (
+	upgradeDelta = 0x04 // flag byte: delta understood / sent
+
+	deltaEnd  = 0
+	deltaLit  = 1
+	deltaCopy = 2
+	deltaRun  = 3
+
+	deltaPage     = 64 // flash page size assumed for the ordering constraint
+	deltaMinMatch = 8  // shorter copies and runs are sent as literals
+	deltaCands    = 8  // positions tried per 4-byte prefix of the old image
+	deltaCacheMax = 16 // deltas kept, between pairs of images
+)
+
+// makeDelta returns the ops to turn old into cur in place, padded to whole
+// chunks, or nil if sending cur itself would not be more than a quarter larger.
+func makeDelta(old, cur []byte) []byte {
+	index := map[uint32][]int{}
+	for i := 0; i+4 <= len(old); i++ {
+		k := get32(old[i:])
+		if c := index[k]; len(c) < deltaCands {
+			index[k] = append(c, i)
+		}
+	}
+
+	var ops, lit []byte
+	flushLit := func() {
+		if len(lit) > 0 {
+			ops = append16(append(ops, deltaLit), uint16(len(lit)))
+			ops = append(ops, lit...)
+			lit = lit[:0]
+		}
+	}
+	for i := 0; i < len(cur); {
+		run := 1
+		for i+run < len(cur) && cur[i+run] == cur[i] && run < 0xFFFF {
+			run++
+		}
+		src, n := -1, 0
+		try := func(s int) {
+			if m := safeMatch(old, cur, s, i); m > n {
+				src, n = s, m
+			}
+		}
+		try(i) // most of the image is usually still in the same place
+		if i+4 <= len(cur) {
+			for _, s := range index[get32(cur[i:])] {
+				try(s)
+			}
+		}
+		switch {
+		case n >= deltaMinMatch && n >= run:
+			flushLit()
+			ops = append16(append16(append(ops, deltaCopy), uint16(src)), uint16(n))
+			i += n
+		case run >= deltaMinMatch:
+			flushLit()
+			ops = append16(append(ops, deltaRun, cur[i]), uint16(run))
+			i += run
+		default:
+			lit = append(lit, cur[i])
+			i++
+			if len(lit) == 0xFFFF {
+				flushLit()
+			}
+		}
+	}
+	flushLit()
+	ops = append(ops, deltaEnd)
+	for len(ops)%chunkSize != 0 {
+		ops = append(ops, deltaEnd)
+	}
+	if 4*len(ops) > 3*len(cur) {
+		return nil
+	}
+	return ops
+}
+
+// safeMatch returns how many bytes of old from s on match cur from d on, up
+// to where the copy would read a flash page which is no longer available.
+func safeMatch(old, cur []byte, s, d int) int {
+	n := 0
+	for s+n < len(old) && d+n < len(cur) && n < 0xFFFF &&
+		old[s+n] == cur[d+n] && s+n >= (d+n)&^(deltaPage-1)-deltaPage {
+		n++
+	}
+	return n
+}
+
+func get32(b []byte) uint32 {
+	return uint32(b[0]) | uint32(b[1])<<8 | uint32(b[2])<<16 | uint32(b[3])<<24
+}
+
+// deltaCache keeps the deltas generated, as images ready to be downloaded.
+var deltaCache = struct {
+	sync.Mutex
+	m map[[2]*firmware]*firmware
+}{m: map[[2]*firmware]*firmware{}}
+
+// deltaFor returns the delta from the image a node reports to fw, or nil if
+// the server doesn't have that image, or a delta would not be worth it.
+func deltaFor(cfg *nodeConfig, ureq *upgradeRequest, fw *firmware) *firmware {
+	old := cfg.GetFirmware(ureq.SwID)
+	if old == nil || old == fw || old.crc != ureq.SwCheck ||
+		uint16(old.size>>4) != ureq.SwSize {
+		return nil
+	}
+	key := [2]*firmware{old, fw}
+	deltaCache.Lock()
+	defer deltaCache.Unlock()
+	if d, ok := deltaCache.m[key]; ok {
+		return d
+	}
+	var d *firmware
+	if ops := makeDelta(old.bytes(), fw.bytes()); ops != nil {
+		d = &firmware{crc: fw.crc, data: ops}
+		d.prepare()
+	}
+	if len(deltaCache.m) >= deltaCacheMax {
+		for k, v := range deltaCache.m {
+			if v != nil {
+				chunkStore.release(v.chunks)
+			}
+			delete(deltaCache.m, k)
+			break
+		}
+	}
+	deltaCache.m[key] = d
+	return d
+}
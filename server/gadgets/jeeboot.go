@@ -1,26 +1,32 @@
 package jeeboot
 
 import (
-	"bytes"
-	"encoding/binary"
 	"encoding/hex"
 	"encoding/json"
-	"fmt"
 	"strconv"
 	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
 
 	"code.google.com/p/go-uuid/uuid"
 	"github.com/golang/glog"
 	"github.com/jcw/flow"
 )
 
-// FIXME: bootFiles is shared between the BootData and JeeBoot gadgets
-// 	apart from introducing race conditions, it also bypasses the flow approach
-var bootFiles = map[string]*firmware{}
+// bootFiles is shared between the BootData and JeeBoot gadgets, each image is
+// only published once it is complete, readers never see partial updates
+// FIXME: this still bypasses the flow approach
+var bootFiles firmwareStore
+
+// bootConfig holds the current config, shared by all JeeBoot gadgets
+var bootConfig configStore
 
 func init() {
 	flow.Registry["BootData"] = func() flow.Circuitry { return &BootData{} }
 	flow.Registry["JeeBoot"] = func() flow.Circuitry { return &JeeBoot{} }
+	flow.Registry["WatchFiles"] = func() flow.Circuitry { return &WatchFiles{} }
+	flow.Registry["ReadConfigJSON"] = func() flow.Circuitry { return &ReadConfigJSON{} }
 }
 
 // BootData takes the datafiles and adds them to the configuration settings.
@@ -32,108 +38,311 @@ type BootData struct {
 // Process data from the ReadFileText/IntelHex/BinaryFill/CrcCalc pipeline.
 func (w *BootData) Run() {
 	var name string
+	var fw *firmware
 	for m := range w.In {
 		switch v := m.(type) {
 		case flow.Tag:
 			switch v.Tag {
 			case "<open>":
 				name = v.Msg.(string)
-				bootFiles[name] = &firmware{}
+				fw = &firmware{}
 			case "<addr>":
-				bootFiles[name].addr = v.Msg.(int)
+				fw.addr = v.Msg.(int)
 			case "<crc16>":
-				bootFiles[name].crc = v.Msg.(uint16)
+				fw.crc = v.Msg.(uint16)
 			case "<close>":
-				fw := bootFiles[name]
-				glog.Infof("bootFile %s = addr %d crc %d (0x%04x) len %d",
-					name, fw.addr, fw.crc, fw.crc, len(fw.data))
+				fresh := fw.prepare()
+				bootFiles.publish(name, fw)
+				glog.Infof("bootFile %s = addr %d crc %d (0x%04x) len %d, %d new chunks",
+					name, fw.addr, fw.crc, fw.crc, fw.size, fresh)
+				fw = nil
 			}
 		case []byte:
-			bootFiles[name].data = v
+			fw.data = v
 		}
 	}
 }
 
+// pairingGroup is the net group used by the bootloader before it is paired.
+const pairingGroup = 212
+
 // This takes JeeBoot requests and returns the desired information as reply.
+// There is one JeeBoot gadget per gateway, they all share the same config,
+// so only one of them needs to have its Cfg input and Files output connected.
+// Each message on Group adds a net group this gateway listens on, requests
+// from other groups are ignored. Group is read to the end before starting.
+// A "<group>" tag on In sets the group of the requests which follow it, for
+// gateways which listen on more than one group. Such a gateway drops requests
+// until it gets the first tag: without it, the group would only be a guess,
+// and the node could be mistaken for another one with the same ID.
 type JeeBoot struct {
 	flow.Gadget
 	In    flow.Input
 	Cfg   flow.Input
+	Group flow.Input
 	Out   flow.Output
 	Files flow.Output
 
-	dev string
-	cfg config
+	dev     string
+	group   uint8     // net group of the current request
+	tagged  bool      // group was set by a "<group>" tag
+	groups  [256]bool // groups to respond to, all of them if none were set
+	nGroup  int       // number of groups set
+	arrival time.Time // when the current request came in, if tagged
+	board   uint8     // board type of the node sending the current request
+
+	streams map[nodeKey]*pushStream // downloads in push mode
+	ticker  *time.Ticker            // paces the streams, nil if there are none
+
+	bcasts    map[bcastKey]*bcastSession // broadcast sessions
+	bcastTick *time.Ticker               // paces them, nil if there are none
+
+	downloads map[nodeKey]time.Time // download slots taken, with last request
+	refused   map[nodeKey]time.Time // nodes told to wait for a slot
+
+	slots     map[nodeKey]*timeSlot // time slots of the pull downloads
+	nSlots    int                   // slots per frame
+	slotEpoch time.Time             // start of the first frame
+	due       time.Time             // when to release the current reply, if held
+	held      []heldReply           // replies held until their slot, by due time
+	holdTimer *time.Timer           // fires when the first held reply is due
 }
 
-// Start decoding JeeBoot packets.
+// Start decoding JeeBoot packets, and pick up each new config as it comes in.
 func (w *JeeBoot) Run() {
-	if m, ok := <-w.Cfg; ok {
-		data, err := json.Marshal(m) // TODO: messy, encode again, then decode!
-		flow.Check(err)
-		err = json.Unmarshal(data, &w.cfg)
-		flow.Check(err)
-		glog.Infof("config: %+v", w.cfg)
-		for _, f := range w.cfg.SwIDs {
-			w.Files.Send(f)
+	w.group = pairingGroup
+	for m := range w.Group {
+		w.addGroup(m.(int))
+	}
+	cfgIn := w.Cfg
+	if m, ok := <-cfgIn; ok {
+		w.loadConfig(m)
+	}
+	defer func() {
+		runTicker(&w.ticker, false, 0)
+		runTicker(&w.bcastTick, false, 0)
+		if w.holdTimer != nil {
+			w.holdTimer.Stop()
+		}
+	}()
+	for {
+		tick, bcastTick := w.pushTicker(), w.bcastTicker()
+		select {
+		case now := <-tick:
+			w.pushChunks(now)
+		case now := <-bcastTick:
+			w.broadcastChunks(now)
+		case now := <-w.holdTimeout():
+			w.releaseHeld(now)
+		case m, ok := <-cfgIn:
+			if !ok {
+				cfgIn = nil
+				continue
+			}
+			w.loadConfig(m)
+		case m, ok := <-w.In:
+			if !ok {
+				return
+			}
+			switch v := m.(type) {
+			case flow.Tag:
+				switch v.Tag {
+				case "<group>":
+					w.group = uint8(v.Msg.(int))
+					w.tagged = true
+				case "<arrival>":
+					w.arrival = v.Msg.(time.Time)
+				}
+			case []byte:
+				switch {
+				case len(v) == 0 || !w.listensTo(w.group):
+				case w.nGroup > 1 && !w.tagged:
+					bootLog.add(0, logEvent{kind: logNoGroup, hdr: v[0]})
+				default:
+					w.handleRequest(v)
+				}
+				w.arrival = time.Time{}
+			}
 		}
-		w.Files.Disconnect()
 	}
-	for m := range w.In {
-		if req, ok := m.([]byte); ok {
-			reply := w.respondToRequest(req)
-			if reply != nil {
-				cmd := convertReplyToCmd(reply)
-				// fmt.Println("JB reply #", len(req), "->", cmd)
-				w.Out.Send(cmd)
+}
+
+// handleRequest sends out the reply to a request, with its deadline, unless
+// it's already too late for the node to receive it.
+func (w *JeeBoot) handleRequest(req []byte) {
+	arrival := w.arrival
+	if arrival.IsZero() {
+		arrival = time.Now() // not stamped, e.g. in tests
+	}
+	buf := cmdBuffers.Get().(*[]byte)
+	if cmd := w.respondToRequest(req, (*buf)[:0]); len(cmd) > 0 {
+		deadline := arrival.Add(bootConfig.get().replyWindow(w.board))
+		if now := time.Now(); now.After(deadline) {
+			atomic.AddUint64(&staleReplies[w.board], 1)
+		} else {
+			// the reply outlives buf: this copy and boxing it and its tags in
+			// sendCmd are the only allocations per request, see TestZeroAllocs
+			s := string(cmd)
+			if w.due.After(now) {
+				w.holdReply(heldReply{due: w.due, deadline: deadline, group: w.group,
+					cmd: s}, now)
+			} else {
+				w.sendCmd(w.group, deadline, s)
 			}
+			bootLog.add(2, logEvent{kind: logReply, hdr: req[0], text: s})
 		}
+		*buf = cmd
+	}
+	cmdBuffers.Put(buf)
+}
+
+// sendCmd passes a command on to the radio, with its deadline. A gateway which
+// listens on all groups also has to be told which group to send it on.
+func (w *JeeBoot) sendCmd(group uint8, deadline time.Time, cmd string) {
+	if w.nGroup > 1 {
+		w.Out.Send(groupTag(int(group)))
+	}
+	w.Out.Send(deadlineTag(deadline))
+	w.Out.Send(cmd)
+}
+
+// groupTag returns the tag which announces the net group of the next packet.
+func groupTag(group int) flow.Tag {
+	return flow.Tag{Tag: "<group>", Msg: group}
+}
+
+// addGroup adds a net group to respond to, the first one is also the default.
+func (w *JeeBoot) addGroup(group int) {
+	if w.nGroup == 0 {
+		w.group = uint8(group)
+	}
+	w.groups[uint8(group)] = true
+	w.nGroup++
+}
+
+// listensTo returns true if requests from this net group should be answered.
+func (w *JeeBoot) listensTo(group uint8) bool {
+	return w.nGroup == 0 || w.groups[group]
+}
+
+// loadConfig replaces the current config, and requests its firmware files.
+// A config which doesn't decode is logged, and the previous one stays.
+func (w *JeeBoot) loadConfig(m flow.Message) {
+	var cfg config
+	data, err := json.Marshal(m) // TODO: messy, encode again, then decode!
+	if err == nil {
+		err = json.Unmarshal(data, &cfg)
 	}
+	if err != nil {
+		glog.Errorln("config not loaded, keeping the previous one:", err)
+		return
+	}
+	glog.Infof("config: %+v", cfg)
+	bootConfig.publish(cfg)
+	// files which are already loaded will be ignored by the WatchFiles gadget
+	for _, f := range cfg.SwIDs {
+		w.Files.Send(f)
+	}
+}
+
+// getFirmware returns the image a node should download for the given swId, or
+// nil if no upgrade request was seen, e.g. after a server restart without the
+// state journal. The node might be applying a delta, which can't be told from
+// a download of the image itself: sending it image chunks would corrupt its
+// flash, so it is not answered, and starts over with an upgrade request.
+func (w *JeeBoot) getFirmware(cfg *nodeConfig, key nodeKey,
+	swID uint16) *firmware {
+	return sessions.pinned(cfg, key, swID)
 }
 
-func convertReplyToCmd(reply interface{}) string {
-	var buf bytes.Buffer
-	err := binary.Write(&buf, binary.LittleEndian, reply)
-	flow.Check(err)
-	fmt.Printf("JB reply %x\n", buf.Bytes())
-	cmd := strings.Replace(fmt.Sprintf("%v", buf.Bytes()), " ", ",", -1)
-	return cmd[1:len(cmd)-1] + ",81s" // FIXME: hard-coded 64+17!
+// cmdBuffers holds scratch buffers for encoding reply commands.
+var cmdBuffers = sync.Pool{
+	New: func() interface{} {
+		b := make([]byte, 0, 4*maxReplySize)
+		return &b
+	},
 }
 
+// maxReplySize is the maximum payload size of a reply, as sent by RF12demo.
+const maxReplySize = 66
+
 type firmware struct {
-	addr int
-	crc  uint16
-	data []byte
+	addr   int
+	crc    uint16
+	size   int      // in bytes, as loaded
+	data   []byte   // the image as loaded, replaced by chunks in prepare
+	chunks []*chunk // the image, chunks shared with all other images
 }
 
-type config struct {
-	SwIDs map[string]string // map SwIDs to filenames
-	HwIDs map[string]struct{ Board, Group, Node, SwID float64 }
+// prepare splits the image into shared chunks, with their whitened and
+// encoded payload, so that download requests can be served without any
+// per-request conversion. It returns the number of chunks not seen before.
+func (fw *firmware) prepare() int {
+	fw.size = len(fw.data)
+	fw.chunks = make([]*chunk, len(fw.data)/chunkSize)
+	fresh := 0
+	for i := range fw.chunks {
+		c, isNew := chunkStore.intern(fw.data[chunkSize*i : chunkSize*i+chunkSize])
+		fw.chunks[i] = c
+		if isNew {
+			fresh++
+		}
+	}
+	fw.data = nil
+	return fresh
 }
 
-func (c *config) LookupHwID(hwID []byte) (board, group, node uint8) {
-	key := hex.EncodeToString(hwID)
-	if info, ok := c.HwIDs[key]; ok {
-		board = uint8(info.Board)
-		group = uint8(info.Group)
-		node = uint8(info.Node)
+// bytes returns a copy of the image, as it was loaded.
+func (fw *firmware) bytes() []byte {
+	b := make([]byte, 0, len(fw.chunks)*chunkSize)
+	for _, c := range fw.chunks {
+		b = append(b, c.data[:]...)
 	}
-	return
+	return b
 }
 
-func (c *config) LookupSwID(group, node uint8) uint16 {
-	for _, h := range c.HwIDs {
-		if group == uint8(h.Group) && node == uint8(h.Node) {
-			return uint16(h.SwID)
+// appendDownloadCmd appends the command to send chunk index of this firmware.
+func (fw *firmware) appendDownloadCmd(cmd []byte, swID, index uint16, dst uint8) []byte {
+	xor := swID ^ index
+	cmd = strconv.AppendUint(cmd, uint64(xor&0xFF), 10)
+	cmd = append(cmd, ',')
+	cmd = strconv.AppendUint(cmd, uint64(xor>>8), 10)
+	cmd = append(cmd, fw.chunks[index].frame...)
+	return appendSend(cmd, dst)
+}
+
+type config struct {
+	SwIDs     map[string]string // map SwIDs to filenames
+	HwIDs     map[string]hwEntry
+	Windows   map[string]float64 // reply window in ms, per board type
+	Push      float64            // ms between streamed chunks, 0 for no push mode
+	Broadcast float64            // ms between broadcast chunks, 0 for none
+	Coded     bool               // broadcast coded symbols, instead of repairs
+
+	Rollouts     map[string]rolloutEntry // waves per SwID
+	MaxDownloads float64                 // per gateway, 0 for no limit
+	Tdma         float64                 // ms per download time slot, 0 for none
+
+	files    map[uint16]string // SwIDs, with the numeric keys parsed
+	windows  [256]time.Duration
+	rollouts map[uint16]*rolloutEntry
+}
+
+// hwEntry is the config information for one HwID.
+type hwEntry struct{ Board, Group, Node, SwID float64 }
+
+// parseSwIDs converts the SwIDs keys once, instead of on every lookup.
+func (c *config) parseSwIDs() {
+	c.files = map[uint16]string{}
+	for k, v := range c.SwIDs {
+		if id, err := strconv.Atoi(k); err == nil {
+			c.files[uint16(id)] = v
 		}
 	}
-	return 0
 }
 
 func (c *config) GetFirmware(swId uint16) *firmware {
-	filename := c.SwIDs[strconv.Itoa(int(swId))]
-	// fmt.Println("gfw", swId, filename)
-	return bootFiles[filename]
+	return bootFiles.get(c.files[swId])
 }
 
 type pairingRequest struct {
@@ -179,79 +388,165 @@ type downloadReply struct {
 	Data    [64]uint8 // download payload
 }
 
-func (w *JeeBoot) respondToRequest(req []byte) interface{} {
-	// fmt.Printf("rtr %s %x %d\n", w.dev, req, len(req))
+// respondToRequest appends the command to send as reply to cmd, if any. It
+// also sets w.board to the board type of the requesting node, if known, and
+// w.due to when the reply should be sent, if it is to be held for a slot.
+func (w *JeeBoot) respondToRequest(req []byte, cmd []byte) []byte {
+	var raw [maxReplySize]byte
+	cfg := bootConfig.get()
+	hdr := req[0]
+	w.board = 0
+	w.due = time.Time{}
 	switch len(req) - 1 {
 
 	case 22:
 		var preq pairingRequest
-		hdr := unpackReq(req, &preq)
+		preq.decode(req[1:])
+		w.board = preq.Board
 		// if HwID is all zeroes, we need to issue a new random value
 		if preq.HwID == [16]byte{} {
 			reply := pairingAssign{Board: preq.Board}
 			copy(reply.HwID[:], newRandomID())
-			fmt.Printf("assigning fresh hardware ID %x for board %d hdr %08b\n",
-				reply.HwID, preq.Board, hdr)
-			return reply
+			bootLog.add(0, logEvent{kind: logAssign, hdr: hdr, board: preq.Board,
+				hwID: reply.HwID})
+			id := hex.EncodeToString(reply.HwID[:])
+			bootState.put(journalEntry{Key: "a:" + id,
+				Assign: &assignment{id, preq.Board, time.Now()}})
+			return appendCmd(cmd, reply.appendTo(raw[:0]), 0)
 		}
-		board, group, node := w.cfg.LookupHwID(preq.HwID[:])
-		glog.Infoln("key", preq.HwID, "b/g/n", board, group, node)
+		board, group, node := cfg.reg.lookupHwID(preq.HwID)
 		if board == preq.Board && group != 0 && node != 0 {
-			fmt.Printf("pair %x board %d hdr %08b\n", preq.HwID, board, hdr)
+			bootLog.add(0, logEvent{kind: logPair, hdr: hdr, board: board,
+				group: group, node: node, hwID: preq.HwID})
+			sessions.pairing(nodeKey{group, node}, time.Now())
 			reply := pairingReply{Board: board, Group: group, NodeID: node}
-			return reply
+			// the node is still unpaired, with its own ID unknown: broadcast
+			return appendCmd(cmd, reply.appendTo(raw[:0]), 0)
 		}
-		fmt.Printf("pair %x board %d - no entry\n", preq.HwID, board)
+		bootLog.add(0, logEvent{kind: logNoEntry, hdr: hdr, board: preq.Board,
+			hwID: preq.HwID})
 
-	case 8:
+	case 8, 9: // 9 with the flags byte, see push.go, rollout.go, delta.go, broadcast.go
 		var ureq upgradeRequest
-		hdr := unpackReq(req, &ureq)
-		group, node := uint8(212), hdr&0x1F // FIXME hard-coded for now
+		ureq.decode(req[1:])
+		w.board = ureq.Board
+		key := nodeKey{w.group, hdr & 0x1F}
+		delete(w.streams, key)
+		var flags uint8
+		if len(req) == 10 {
+			flags = req[9]
+		}
+		now := time.Now()
 		// upgradeRequest can be used as reply as well, it has the same fields
-		reply := &ureq
-		reply.SwID = w.cfg.LookupSwID(group, node)
-		if fw := w.cfg.GetFirmware(reply.SwID); fw != nil {
-			reply.SwSize = uint16(len(fw.data) >> 4)
+		reply := upgradeReply(ureq)
+		reply.SwID = cfg.reg.lookupSwID(key.group, key.node)
+		if reply.SwID != ureq.SwID && cfg.GetFirmware(ureq.SwID) != nil &&
+			!cfg.admitWave(key, reply.SwID, now) {
+			reply.SwID = ureq.SwID // not its turn yet, keep the current software
+			atomic.AddUint64(&rolloutCounts.held, 1)
+		}
+		if fw := cfg.GetFirmware(reply.SwID); fw != nil {
+			reply.SwSize = uint16(fw.size >> 4)
 			reply.SwCheck = fw.crc
-			fmt.Printf("upgrade %v hdr %08b\n", reply, hdr)
-			return reply
+			bcast := flags&upgradeBcast != 0 && cfg.bcastInterval() > 0
+			coded := bcast && flags&upgradeCoded != 0 && cfg.Coded
+			bcast = bcast && w.bcastFree(bcastKey{key.group, reply.SwID, coded}, fw)
+			coded = coded && bcast
+			joined := bcast && w.joinBroadcast(key.group, reply.SwID, fw, coded)
+			if reply == upgradeReply(ureq) {
+				w.endDownload(key) // up to date, unless its flash got corrupted
+			} else if joined {
+				// no download slot needed, the chunks are sent anyway
+			} else if wait := w.admitDownload(cfg, key, now); wait > 0 {
+				if flags&upgradeBusy == 0 {
+					return cmd // can't tell it to wait, it will back off
+				}
+				busy := upgradeReply(ureq) // the node's own software, unchanged
+				payload := append(busy.appendTo(raw[:0]), upgradeBusy, wait)
+				return appendCmd(cmd, payload, hdrDst|key.node)
+			}
+			var delta *firmware
+			if flags&upgradeDelta != 0 && reply.SwID != ureq.SwID {
+				delta = deltaFor(cfg, &ureq, fw)
+			}
+			download, base := fw, (*upgradeRequest)(nil)
+			if delta != nil {
+				download = delta // the node downloads the ops instead of the image
+				b := ureq
+				base = &b
+			}
+			// a new boot, so the download will use the current image from now on
+			sessions.upgrade(key, reply.SwID, download, base, now)
+			bootLog.add(1, logEvent{kind: logUpgrade, hdr: hdr, board: reply.Board,
+				group: key.group, node: key.node, swID: reply.SwID,
+				size: len(download.chunks) * chunkSize})
+			payload := reply.appendTo(raw[:0])
+			if len(req) == 10 {
+				var reflags uint8
+				switch {
+				case delta == nil && bcast:
+					reflags = upgradeBcast
+					if coded {
+						reflags |= upgradeCoded
+					}
+					// also keeps a coded session going for one more span
+					w.startBroadcast(key.group, reply.SwID, fw, coded, now)
+				case flags&upgradePush != 0 && cfg.pushInterval() > 0:
+					reflags = upgradePush
+					w.startStream(key, reply.SwID, download, now)
+				}
+				if delta != nil {
+					payload = append16(append(payload, reflags|upgradeDelta),
+						uint16(len(delta.chunks)))
+				} else {
+					payload = append(payload, reflags)
+				}
+			}
+			return appendCmd(cmd, payload, hdrDst|key.node)
 		}
 
+	case 12:
+		var rreq repairRequest
+		rreq.decode(req[1:])
+		key := nodeKey{w.group, hdr & 0x1F}
+		w.board = cfg.reg.lookupBoard(key.group, key.node)
+		w.repairBroadcast(cfg, key, &rreq, time.Now())
+
 	case 4:
 		var dreq downloadRequest
-		hdr := unpackReq(req, &dreq)
-		if fw := w.cfg.GetFirmware(dreq.SwID); fw != nil {
-			offset := 64 * dreq.SwIndex // FIXME hard-coded
-			reply := downloadReply{SwIDXor: dreq.SwID ^ dreq.SwIndex}
-			fmt.Println("len", len(fw.data), "offset", offset, offset+64)
-			if int(offset+64) > len(fw.data) {
-				fmt.Printf("no data at %d..%d\n", offset, offset+64)
-				return &struct{ SwIDXor uint16 }{
-					SwIDXor: dreq.SwID ^ dreq.SwIndex,
-				}
+		dreq.decode(req[1:])
+		key := nodeKey{w.group, hdr & 0x1F}
+		w.board = cfg.reg.lookupBoard(key.group, key.node)
+		if s := w.streams[key]; s != nil || dreq.SwIndex&pushHole != 0 {
+			w.ackStream(cfg, key, dreq, time.Now())
+			return cmd // nothing to send now, the chunks follow on each tick
+		}
+		if fw := w.getFirmware(cfg, key, dreq.SwID); fw != nil {
+			if int(dreq.SwIndex) >= len(fw.chunks)-1 {
+				w.endDownload(key)
+			} else {
+				w.touchDownload(key, time.Now())
+				w.due = w.slotDue(cfg, key, dreq.SwIndex)
 			}
-			for i, v := range fw.data[offset : offset+64] {
-				reply.Data[i] = v ^ uint8(211*i)
+			if int(dreq.SwIndex) >= len(fw.chunks) {
+				bootLog.add(0, logEvent{kind: logNoData, hdr: hdr, group: key.group,
+					node: key.node, swID: dreq.SwID, index: dreq.SwIndex})
+				return appendCmd(cmd, append16(raw[:0], dreq.SwID^dreq.SwIndex),
+					hdrDst|key.node)
 			}
-			fmt.Printf("download hdr %08b\n", hdr)
-			return reply
+			sessions.download(key, dreq.SwIndex, 64, time.Now())
+			if sampleChunk(dreq.SwIndex, len(fw.chunks)) {
+				bootLog.add(1, logEvent{kind: logDownload, hdr: hdr, group: key.group,
+					node: key.node, swID: dreq.SwID, index: dreq.SwIndex})
+			}
+			return fw.appendDownloadCmd(cmd, dreq.SwID, dreq.SwIndex, hdrDst|key.node)
 		}
 
 	default:
-		fmt.Printf("bad req? %d b = %d\n", len(req), req)
+		bootLog.add(0, logEvent{kind: logBadReq, hdr: hdr, size: len(req)})
 	}
 
-	return nil
-}
-
-func unpackReq(data []byte, req interface{}) (h uint8) {
-	reader := bytes.NewReader(data)
-	err := binary.Read(reader, binary.LittleEndian, &h)
-	flow.Check(err)
-	err = binary.Read(reader, binary.LittleEndian, req)
-	flow.Check(err)
-	// fmt.Printf("%08b %x\n", h, req)
-	return
+	return cmd
 }
 
 func newRandomID() []byte {
@@ -1,7 +1,20 @@
 package jeeboot
 
 import (
+	"bufio"
+	"bytes"
+	"crypto/sha256"
+	"encoding/binary"
 	"encoding/json"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"testing"
+	"time"
 
 	"github.com/jcw/flow"
 )
@@ -39,7 +52,1273 @@ func ExampleJeeBoot() {
 	g.Run()
 	// Output:
 	// Lost string: ../firmware/blinkAvr1.hex
-	// pair 06300301c48461aeedb09351061900f5 board 2 hdr 11100000
-	// JB reply 0002d41100000000000000000000000000000000
-	// Lost string: 0,2,212,17,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,81s
+	// Lost string: 0,2,212,17,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0s
+}
+
+// referenceCmd is the original reflection-based encoding of reply commands.
+func referenceCmd(reply interface{}, dst string) string {
+	var buf bytes.Buffer
+	err := binary.Write(&buf, binary.LittleEndian, reply)
+	flow.Check(err)
+	cmd := strings.Replace(fmt.Sprintf("%v", buf.Bytes()), " ", ",", -1)
+	return cmd[1:len(cmd)-1] + "," + dst + "s"
+}
+
+// freshStores empties the firmware, chunk, config, and rollout state which is
+// shared by all gadgets, so that a test doesn't depend on what earlier tests,
+// or an earlier run of itself with -count, left behind.
+func freshStores() {
+	bootFiles.snap.Store(firmwareSet{})
+	bootConfig.snap.Store(emptyConfig)
+	chunkStore = &chunkTable{m: map[[sha256.Size]byte]*chunk{}}
+	rolloutStarts.Lock()
+	rolloutStarts.m = map[uint16]rolloutRecord{}
+	rolloutStarts.Unlock()
+}
+
+// publishImage loads an image under a file name, as the BootData gadget does.
+func publishImage(name string, data []byte, crc uint16) *firmware {
+	fw := &firmware{data: data, crc: crc}
+	fw.prepare()
+	bootFiles.publish(name, fw)
+	return fw
+}
+
+func TestDownloadCmd(t *testing.T) {
+	data := make([]byte, 128)
+	for i := range data {
+		data[i] = byte(i * 7)
+	}
+	fw := &firmware{data: data}
+	fw.prepare()
+
+	for index := uint16(0); index < 2; index++ {
+		reply := downloadReply{SwIDXor: 1001 ^ index}
+		for i, v := range data[64*index : 64*index+64] {
+			reply.Data[i] = v ^ uint8(211*i)
+		}
+		want := referenceCmd(reply, "81")
+		got := string(fw.appendDownloadCmd(nil, 1001, index, hdrDst|17))
+		if got != want {
+			t.Errorf("chunk %d: got %q, want %q", index, got, want)
+		}
+	}
+}
+
+func TestCodec(t *testing.T) {
+	in := []byte{
+		1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+		13, 14, 15, 16, 17, 18, 19, 20, 21, 22,
+	}
+	var p, pRef pairingRequest
+	p.decode(in)
+	binary.Read(bytes.NewReader(in), binary.LittleEndian, &pRef)
+	var u, uRef upgradeRequest
+	u.decode(in)
+	binary.Read(bytes.NewReader(in), binary.LittleEndian, &uRef)
+	var d, dRef downloadRequest
+	d.decode(in)
+	binary.Read(bytes.NewReader(in), binary.LittleEndian, &dRef)
+	if p != pRef || u != uRef || d != dRef {
+		t.Errorf("decode mismatch: %v %v %v", p, u, d)
+	}
+
+	pa := pairingAssign{Board: 2, HwID: pRef.HwID}
+	pr := pairingReply{Board: 2, Group: 212, NodeID: 17, ShKey: pRef.HwID}
+	ur := upgradeReply{Board: 2, SwID: 1001, SwSize: 1234, SwCheck: 54321}
+	for _, c := range []struct {
+		got  []byte
+		want interface{}
+	}{
+		{pa.appendTo(nil), pa},
+		{pr.appendTo(nil), pr},
+		{ur.appendTo(nil), ur},
+	} {
+		if got, want := string(appendCmd(nil, c.got, hdrDst|17)), referenceCmd(c.want, "81"); got != want {
+			t.Errorf("encode: got %q, want %q", got, want)
+		}
+	}
+}
+
+func TestZeroAllocs(t *testing.T) {
+	freshStores()
+	w := JeeBoot{group: 212}
+	bootConfig.publish(config{
+		SwIDs: map[string]string{"1001": "test.hex"},
+		HwIDs: map[string]hwEntry{
+			"06300301c48461aeedb09351061900f5": {2, 212, 17, 1001},
+		},
+	})
+	publishImage("test.hex", make([]byte, 1024), 12345)
+
+	upgrade := []byte{177, 0, 2, 1, 0, 17, 0, 99, 36}
+	download := []byte{177, 233, 3, 5, 0}
+	buf := make([]byte, 0, 4*maxReplySize)
+
+	for _, req := range [][]byte{upgrade, download} {
+		n := testing.AllocsPerRun(100, func() {
+			buf = w.respondToRequest(req, buf[:0])
+		})
+		if len(buf) == 0 || n != 0 {
+			t.Errorf("req %v: %d bytes, %v allocs", req, len(buf), n)
+		}
+	}
+
+	// Handing a reply on costs sendAllocs: the reply string, which outlives
+	// the request, and boxing it, the deadline tag, and the deadline in that
+	// tag into a flow.Message. Those are the gadget interface, not the codec.
+	w.Out = discard{}
+	for _, req := range [][]byte{upgrade, download} {
+		n := testing.AllocsPerRun(100, func() {
+			w.handleRequest(req)
+		})
+		if n != sendAllocs {
+			t.Errorf("req %v: %v allocs to send, want %d", req, n, sendAllocs)
+		}
+	}
+}
+
+const sendAllocs = 4
+
+// discard drops everything sent to it, it's an Output which doesn't allocate.
+type discard struct{}
+
+func (discard) Send(m flow.Message) {}
+func (discard) Disconnect()         {}
+
+func TestStoreSnapshots(t *testing.T) {
+	var store firmwareStore
+	done := make(chan bool)
+	go func() {
+		for i := 1; i <= 1000; i++ {
+			fw := &firmware{crc: uint16(i), data: make([]byte, i)}
+			store.publish("a.hex", fw)
+			store.publish("b.hex", fw)
+		}
+		close(done)
+	}()
+	for {
+		select {
+		case <-done:
+			if fw := store.get("b.hex"); fw == nil || fw.crc != 1000 {
+				t.Errorf("final snapshot: %v", fw)
+			}
+			return
+		default:
+			if fw := store.get("a.hex"); fw != nil && int(fw.crc) != len(fw.data) {
+				t.Fatalf("inconsistent image: crc %d len %d", fw.crc, len(fw.data))
+			}
+		}
+	}
+}
+
+func TestBadConfig(t *testing.T) {
+	freshStores()
+	dir, err := ioutil.TempDir("", "jeeboot")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	good, half := filepath.Join(dir, "good.json"), filepath.Join(dir, "half.json")
+	ioutil.WriteFile(good, []byte(`{"swids": {"1010": "good.hex"}}`), 0644)
+	ioutil.WriteFile(half, []byte(`{"swids": {"10`), 0644)
+
+	in := make(chan flow.Message, 3)
+	in <- half // still being saved
+	in <- filepath.Join(dir, "missing.json")
+	in <- good
+	close(in)
+	var out sentCmds
+	g := ReadConfigJSON{In: in, Out: &out}
+	g.Run()
+	if len(out) != 1 {
+		t.Fatalf("configs read: %v", out)
+	}
+
+	var files sentCmds
+	w := JeeBoot{Files: &files}
+	w.loadConfig(out[0])
+	w.loadConfig(map[string]interface{}{"swids": 5}) // wrong type
+	if f := bootConfig.get().files[1010]; f != "good.hex" || len(files) != 1 {
+		t.Errorf("config after a bad one: %q, files %v", f, files)
+	}
+}
+
+func TestPinnedDownload(t *testing.T) {
+	freshStores()
+	w := JeeBoot{group: 212}
+	bootConfig.publish(config{
+		SwIDs: map[string]string{"1002": "pin.hex"},
+		HwIDs: map[string]hwEntry{
+			"06300301c48461aeedb09351061900f5": {2, 212, 17, 1002},
+		},
+	})
+	image := func(fill byte) *firmware {
+		fw := &firmware{data: bytes.Repeat([]byte{fill}, 128)}
+		fw.prepare()
+		return fw
+	}
+	old, cur := image(1), image(2)
+
+	upgrade := []byte{177, 0, 2, 1, 0, 17, 0, 99, 36}
+	download := []byte{177, 234, 3, 1, 0}
+	bootFiles.publish("pin.hex", old)
+	w.respondToRequest(upgrade, nil)
+	bootFiles.publish("pin.hex", cur)
+
+	got := string(w.respondToRequest(download, nil))
+	if want := string(old.appendDownloadCmd(nil, 1002, 1, hdrDst|17)); got != want {
+		t.Errorf("reloaded image used mid-download: %q", got)
+	}
+	w.respondToRequest(upgrade, nil)
+	got = string(w.respondToRequest(download, nil))
+	if want := string(cur.appendDownloadCmd(nil, 1002, 1, hdrDst|17)); got != want {
+		t.Errorf("new boot did not switch to reloaded image: %q", got)
+	}
+}
+
+// sentCmds collects everything sent to it, as a stand-in for a flow.Output.
+type sentCmds []flow.Message
+
+func (s *sentCmds) Send(m flow.Message) { *s = append(*s, m) }
+func (s *sentCmds) Disconnect()         {}
+
+func TestGroups(t *testing.T) {
+	freshStores()
+	bootConfig.publish(config{
+		SwIDs: map[string]string{"1003": "grp.hex"},
+		HwIDs: map[string]hwEntry{
+			"06300301c48461aeedb09351061900f5": {2, 100, 5, 1003},
+		},
+	})
+	publishImage("grp.hex", make([]byte, 128), 0)
+
+	in, cfg, group := make(chan flow.Message, 10), make(chan flow.Message), make(chan flow.Message, 2)
+	close(cfg)
+	group <- 212
+	group <- 100
+	close(group)
+	in <- []byte{165, 0, 2, 0, 0, 0, 0, 0, 0} // no tag: the group is unknown
+	in <- flow.Tag{Tag: "<group>", Msg: 100}
+	in <- []byte{165, 0, 2, 0, 0, 0, 0, 0, 0}
+	in <- []byte{165, 235, 3, 1, 0}
+	in <- flow.Tag{Tag: "<group>", Msg: 101} // not listened to
+	in <- []byte{166, 0, 2, 0, 0, 0, 0, 0, 0}
+	close(in)
+	var out sentCmds
+	jb := JeeBoot{In: in, Cfg: cfg, Group: group, Out: &out}
+	jb.Run()
+	// two replies, each with a group and a deadline tag
+	if len(out) != 6 || out[0] != groupTag(100) {
+		t.Errorf("replies: %q", out)
+	}
+
+	var s session
+	for _, v := range sessions.snapshot() {
+		if v.Group == 101 {
+			t.Errorf("request on group 101 was answered")
+		}
+		if v.Group == 100 && v.Node == 5 {
+			s = v
+		}
+	}
+	if s.SwID != 1003 || s.Index != 1 {
+		t.Errorf("session for 100/5: %+v", s)
+	}
+
+	w := JeeBoot{group: 100}
+	got := string(w.respondToRequest([]byte{165, 235, 3, 1, 0}, nil))
+	if !strings.HasSuffix(got, ",69s") {
+		t.Errorf("download reply not sent to node 5: %q", got)
+	}
+}
+
+func TestRegistry(t *testing.T) {
+	a, b := "06300301c48461aeedb09351061900f5", "00112233445566778899aabbccddeeff"
+	var keyA [16]byte
+	copy(keyA[:], []byte{6, 48, 3, 1, 196, 132, 97, 174, 237, 176, 147, 81, 6, 25, 0, 245})
+
+	var r *registry
+	r = r.updated(map[string]hwEntry{a: {2, 212, 17, 1001}, b: {3, 100, 5, 2001}})
+	if board, group, node := r.lookupHwID(keyA); board != 2 || group != 212 || node != 17 {
+		t.Errorf("lookupHwID: %d %d %d", board, group, node)
+	}
+	if r.lookupSwID(212, 17) != 1001 || r.lookupSwID(100, 5) != 2001 {
+		t.Errorf("lookupSwID: %d %d", r.lookupSwID(212, 17), r.lookupSwID(100, 5))
+	}
+
+	// move a to another node, drop b
+	prev := r
+	r = r.updated(map[string]hwEntry{a: {2, 212, 18, 1002}})
+	if prev.lookupSwID(212, 17) != 1001 {
+		t.Errorf("previous registry changed")
+	}
+	if r.lookupSwID(212, 17) != 0 || r.lookupSwID(212, 18) != 1002 ||
+		r.lookupSwID(100, 5) != 0 {
+		t.Errorf("after update: %d %d %d", r.lookupSwID(212, 17),
+			r.lookupSwID(212, 18), r.lookupSwID(100, 5))
+	}
+}
+
+func TestSessions(t *testing.T) {
+	table := &sessionTable{m: map[nodeKey]*session{}, dirty: map[nodeKey]bool{}}
+	key := nodeKey{212, 17}
+	fw := &firmware{chunks: make([]*chunk, 4)}
+	now := time.Unix(1000, 0)
+	table.upgrade(key, 1001, fw, nil, now)
+	for _, index := range []uint16{0, 1, 1, 2} {
+		now = now.Add(100 * time.Millisecond)
+		table.download(key, index, 64, now)
+	}
+
+	s := table.snapshot()[0]
+	if s.Phase != "download" || s.Index != 2 || s.Bytes != 256 ||
+		s.Retries != 1 || s.Eta != 100*time.Millisecond {
+		t.Errorf("session: %+v", s)
+	}
+	var buf bytes.Buffer
+	table.writeMetrics(&buf)
+	for _, line := range []string{
+		`jeeboot_bytes_served_total{group="212",node="17"} 256`,
+		`jeeboot_retries_total{group="212",node="17"} 1`,
+		`jeeboot_phase{group="212",node="17",phase="download"} 1`,
+	} {
+		if !strings.Contains(buf.String(), line+"\n") {
+			t.Errorf("missing metric: %s", line)
+		}
+	}
+}
+
+func TestAirtime(t *testing.T) {
+	chunk := "0" + strings.Repeat(",0", 65) + ",81s"
+	if at := airtimeOf(chunk); at < 12*time.Millisecond || at > 13*time.Millisecond {
+		t.Errorf("airtime of a chunk: %v", at)
+	}
+
+	now := time.Unix(1000, 0)
+	s := newTxScheduler(868, now)
+	// send chunks back to back for an hour, this must stay within 1%
+	var total time.Duration
+	for end := now.Add(time.Hour); now.Before(end); {
+		s.push(chunk, 0, now, time.Time{})
+		p, wait := s.next(now)
+		if p.cmd != "" {
+			total += airtimeOf(p.cmd)
+		}
+		now = now.Add(wait + airtimeOf(chunk))
+	}
+	if total > 36*time.Second || total < 35*time.Second {
+		t.Errorf("airtime in one hour: %v", total)
+	}
+
+	// control replies go first, stale chunks are dropped
+	s = newTxScheduler(868, now)
+	s.push(chunk, 0, now, time.Time{})
+	s.push("1,2,3,81s", 100, now, now.Add(time.Second))
+	if p, _ := s.next(now); p.cmd != "1,2,3,81s" || p.group != 100 ||
+		!p.deadline.Equal(now.Add(time.Second)) {
+		t.Errorf("control reply not first: %+v", p)
+	}
+	if p, _ := s.next(now.Add(time.Second)); p.cmd != "" || s.pending() != 0 {
+		t.Errorf("stale chunk sent: %q", p.cmd)
+	}
+}
+
+func TestEventLog(t *testing.T) {
+	l := newEventLog(4) // no sink running, so the queue fills up
+	for i := 0; i < 10; i++ {
+		l.add(0, logEvent{kind: logDownload, index: uint16(i)})
+	}
+	if len(l.ch) != 4 || l.dropped != 6 {
+		t.Errorf("queued %d, dropped %d", len(l.ch), l.dropped)
+	}
+	e := logEvent{kind: logPair, hdr: 224, board: 2, group: 212, node: 17}
+	if got, want := e.String(), "event=pair hdr=11100000 group=212 node=17 board=2"; got != want {
+		t.Errorf("got %q, want %q", got, want)
+	}
+
+	var n int
+	for i := uint16(0); i < 100; i++ {
+		if sampleChunk(i, 100) {
+			n++
+		}
+	}
+	if n != 5 { // 0, 32, 64, 96, and 99
+		t.Errorf("sampled %d chunks", n)
+	}
+}
+
+func TestFraming(t *testing.T) {
+	crc := uint16(0xFFFF)
+	for _, v := range []byte("123456789") {
+		crc = crc16Update(crc, v)
+	}
+	if crc != 0x4B37 { // CRC-16/MODBUS check value
+		t.Errorf("crc: %04x", crc)
+	}
+
+	hdr, data, err := parseSendCmd("1,2,255,81s", nil)
+	if err != nil || hdr != 81 || !bytes.Equal(data, []byte{1, 2, 255}) {
+		t.Errorf("parse: %d %v %v", hdr, data, err)
+	}
+	for _, bad := range []string{"", "81", "1,,2s", "256,0s", "1,2s3", "1 2s"} {
+		if _, _, err := parseSendCmd(bad, nil); err == nil {
+			t.Errorf("accepted %q", bad)
+		}
+	}
+
+	good := appendFrame(nil, frameReceive, []byte{212, 177}, []byte{1, 0, 5, 0})
+	corrupt := append([]byte(nil), good...)
+	corrupt[5] ^= 1
+	var stream []byte
+	stream = append(stream, 0, frameStart, 0, 99) // noise and a bad length
+	stream = append(stream, corrupt...)
+	stream = append(stream, good...)
+	f := frameReader{r: bufio.NewReader(bytes.NewReader(stream))}
+	typ, data, err := f.next()
+	if err != nil || typ != frameReceive ||
+		!bytes.Equal(data, []byte{212, 177, 1, 0, 5, 0}) {
+		t.Errorf("frame: %c %v %v", typ, data, err)
+	}
+	if f.bad != 2 {
+		t.Errorf("bad frames: %d", f.bad)
+	}
+	if _, _, err := f.next(); err != io.EOF {
+		t.Errorf("expected EOF, got %v", err)
+	}
+	if len(good) != 3+6+2 {
+		t.Errorf("frame size: %d", len(good))
+	}
+}
+
+func TestWriteQueue(t *testing.T) {
+	writeStatsMu.Lock()
+	delete(writePorts, "test") // fresh counters, also for -count
+	writeStatsMu.Unlock()
+	q := newWriteQueue("test", " ")
+	now := time.Now()
+	q.push(queuedWrite{data: []byte("c0"), queued: now})
+	for i := 0; i < writeQueueMax; i++ {
+		q.push(queuedWrite{data: []byte(strconv.Itoa(i)), queued: now, bulk: true})
+	}
+	q.push(queuedWrite{data: []byte("c1"), queued: now})
+	q.push(queuedWrite{other: 1, queued: now})
+	q.push(queuedWrite{data: []byte("x"), queued: now})
+	q.push(queuedWrite{data: []byte("late"), queued: now, deadline: now})
+	q.close()
+
+	var writes []string
+	var others []flow.Message
+	q.drain(func(b []byte) error {
+		writes = append(writes, string(b))
+		return nil
+	}, func(m flow.Message) { others = append(others, m) })
+
+	// the oldest five chunks were dropped to make room, the rest is combined
+	if len(writes) != 2 || !strings.HasPrefix(writes[0], "c0 5 6 7 ") ||
+		!strings.HasSuffix(writes[0], " 31 c1") || writes[1] != "x" {
+		t.Errorf("writes: %q", writes)
+	}
+	if len(others) != 1 || others[0] != 1 {
+		t.Errorf("others: %v", others)
+	}
+	st := writeStatsFor("test")
+	if st.dropped != 5 || st.stale != 1 || st.writes != 2 || st.commands != writeQueueMax-2 || st.depth != 0 {
+		t.Errorf("stats: %+v", st.writeCounts)
+	}
+}
+
+func TestDeadlines(t *testing.T) {
+	freshStores()
+	bootConfig.publish(config{
+		SwIDs: map[string]string{"1001": "late.hex"},
+		HwIDs: map[string]hwEntry{
+			"06300301c48461aeedb09351061900f5": {2, 212, 17, 1001},
+		},
+		Windows: map[string]float64{"2": 100},
+	})
+	fw := publishImage("late.hex", make([]byte, 128), 0)
+	if w := bootConfig.get().replyWindow(2); w != 100*time.Millisecond {
+		t.Errorf("window for board 2: %v", w)
+	}
+	if w := bootConfig.get().replyWindow(3); w != replyWindow {
+		t.Errorf("window for board 3: %v", w)
+	}
+
+	now := time.Now()
+	sessions.upgrade(nodeKey{212, 17}, 1001, fw, nil, now)
+	in, cfg := make(chan flow.Message, 4), make(chan flow.Message)
+	close(cfg)
+	in <- flow.Tag{Tag: "<arrival>", Msg: now.Add(-time.Second)}
+	in <- []byte{177, 233, 3, 1, 0} // stale
+	in <- flow.Tag{Tag: "<arrival>", Msg: now}
+	in <- []byte{177, 233, 3, 1, 0}
+	close(in)
+	var out sentCmds
+	before := staleReplies[2]
+	jb := JeeBoot{In: in, Cfg: cfg, Group: cfg, Out: &out}
+	jb.Run()
+
+	if staleReplies[2] != before+1 || len(out) != 2 {
+		t.Fatalf("stale %d, out %q", staleReplies[2]-before, out)
+	}
+	tag, ok := out[0].(flow.Tag)
+	if !ok || tag.Tag != "<deadline>" ||
+		!tag.Msg.(time.Time).Equal(now.Add(100*time.Millisecond)) {
+		t.Errorf("deadline tag: %v", out[0])
+	}
+
+	// RF12demo requests are stamped before they queue up for JeeBoot
+	in = make(chan flow.Message, 3)
+	in <- groupTag(212)
+	in <- []byte{177, 233, 3, 1, 0}
+	in <- []byte{177, 233, 3, 2, 0}
+	close(in)
+	out = nil
+	(&StampArrival{In: in, Out: &out}).Run()
+	if len(out) != 5 || out[0] != groupTag(212) {
+		t.Fatalf("stamped: %v", out)
+	}
+	for _, i := range []int{1, 3} {
+		if tag, ok := out[i].(flow.Tag); !ok || tag.Tag != "<arrival>" ||
+			tag.Msg.(time.Time).Before(now) {
+			t.Errorf("arrival tag: %v", out[i])
+		}
+	}
+}
+
+func TestPush(t *testing.T) {
+	freshStores()
+	bootConfig.publish(config{
+		SwIDs: map[string]string{"1004": "push.hex"},
+		HwIDs: map[string]hwEntry{
+			"06300301c48461aeedb09351061900f5": {2, 212, 17, 1004},
+		},
+		Push: 20,
+	})
+	publishImage("push.hex", make([]byte, 20*64), 0)
+
+	var out sentCmds
+	w := JeeBoot{group: 212, Out: &out}
+	key := nodeKey{212, 17}
+	upgrade := []byte{177, 0, 2, 0, 0, 0, 0, 0, 0}
+	if got := string(w.respondToRequest(upgrade, nil)); strings.Count(got, ",") != 8 {
+		t.Errorf("upgrade reply without push flags: %q", got)
+	}
+	got := string(w.respondToRequest(append(upgrade, upgradePush), nil))
+	if !strings.HasPrefix(got, "0,2,236,3,80,0,") || !strings.HasSuffix(got, ",1,81s") {
+		t.Errorf("upgrade reply with push flag: %q", got)
+	}
+
+	ack := func(index uint16) {
+		req := append16(append16([]byte{177}, 1004), index)
+		if cmd := w.respondToRequest(req, nil); len(cmd) > 0 {
+			t.Errorf("reply to ack %d: %q", index, cmd)
+		}
+	}
+	pushed := func(n int) []uint16 {
+		out = out[:0]
+		now := time.Now()
+		for i := 0; i < n; i++ {
+			w.pushChunks(now)
+		}
+		var sent []uint16
+		for _, m := range out {
+			if s, ok := m.(string); ok {
+				v := strings.Split(s, ",")
+				lo, _ := strconv.Atoi(v[0])
+				hi, _ := strconv.Atoi(v[1])
+				sent = append(sent, uint16(lo|hi<<8)^1004)
+			}
+		}
+		return sent
+	}
+
+	ack(0)
+	if sent := pushed(30); len(sent) != pushWindow || sent[0] != 0 || sent[15] != 15 {
+		t.Errorf("first window: %v", sent)
+	}
+	ack(8)
+	if sent := pushed(30); len(sent) != 4 || sent[0] != 16 { // up to the end
+		t.Errorf("after ack 8: %v", sent)
+	}
+	ack(5 | pushHole)
+	if sent := pushed(3); len(sent) != 3 || sent[0] != 5 {
+		t.Errorf("after hole at 5: %v", sent)
+	}
+	ack(20)
+	if _, ok := w.streams[key]; ok || len(pushed(1)) != 0 {
+		t.Errorf("stream not ended by the final ack")
+	}
+	ack(3 | pushHole) // the final ack got lost, the node asks again
+	if sent := pushed(1); len(sent) != 1 || sent[0] != 3 {
+		t.Errorf("stream not restarted: %v", sent)
+	}
+
+	w.streams[key].lastAck = time.Now().Add(-pushPause - time.Millisecond)
+	if sent := pushed(1); len(sent) != 0 {
+		t.Errorf("chunks sent while the acks stopped: %v", sent)
+	}
+	bootConfig.publish(config{SwIDs: map[string]string{"1004": "push.hex"}})
+	if w.pushTicker() != nil || w.streams != nil {
+		t.Errorf("push mode still on without config")
+	}
+}
+
+func TestRollout(t *testing.T) {
+	freshStores() // rollout starts too
+	bootConfig.publish(config{
+		SwIDs: map[string]string{"1000": "old.hex", "1005": "new.hex"},
+		HwIDs: map[string]hwEntry{
+			"000000000000000000000000000000a1": {2, 212, 21, 1005},
+			"000000000000000000000000000000a2": {2, 212, 22, 1005},
+			"000000000000000000000000000000a3": {2, 212, 23, 1005},
+		},
+		Rollouts: map[string]rolloutEntry{
+			"1005": {Canary: 1, Waves: []float64{100}, Interval: 3600},
+		},
+		MaxDownloads: 1,
+	})
+	publishImage("old.hex", make([]byte, 128), 0x1234)
+	publishImage("new.hex", make([]byte, 128), 0x5678)
+
+	w := JeeBoot{group: 212}
+	upgrade := func(node uint8, flags ...byte) string {
+		req := []byte{0xA0 | node, 0, 2, 232, 3, 8, 0, 0x34, 0x12}
+		return string(w.respondToRequest(append(req, flags...), nil))
+	}
+	if got := upgrade(21); !strings.HasPrefix(got, "0,2,237,3,") {
+		t.Errorf("canary not upgraded: %q", got)
+	}
+	if got := upgrade(22); got != "0,2,232,3,8,0,52,18,86s" {
+		t.Errorf("node held back for its wave: %q", got)
+	}
+
+	rolloutStarts.Lock()
+	r := rolloutStarts.m[1005]
+	r.Start = time.Now().Add(-time.Hour)
+	rolloutStarts.m[1005] = r
+	rolloutStarts.Unlock()
+	if got := upgrade(22); got != "" {
+		t.Errorf("no slot free, no busy flag: %q", got)
+	}
+	if got := upgrade(22, upgradeBusy); got != "0,2,232,3,8,0,52,18,2,10,86s" {
+		t.Errorf("busy reply: %q", got)
+	}
+	if got := upgrade(23, upgradeBusy); !strings.HasSuffix(got, ",2,20,87s") {
+		t.Errorf("second node waiting: %q", got)
+	}
+
+	w.respondToRequest([]byte{0xA0 | 21, 237, 3, 1, 0}, nil) // last chunk
+	if got := upgrade(22, upgradeBusy); !strings.HasPrefix(got, "0,2,237,3,") {
+		t.Errorf("slot not freed after the download: %q", got)
+	}
+
+	// a changed rollout starts over, without an interval all waves are open
+	cfg := bootConfig.get().config
+	cfg.Rollouts = map[string]rolloutEntry{"1005": {Canary: 1, Interval: 7200}}
+	bootConfig.publish(cfg)
+	if got := upgrade(23, upgradeBusy); got != "0,2,232,3,8,0,52,18,0,87s" {
+		t.Errorf("changed rollout not restarted: %q", got)
+	}
+	cfg.Rollouts = map[string]rolloutEntry{"1005": {Canary: 1}}
+	bootConfig.publish(cfg)
+	if got := upgrade(23, upgradeBusy); !strings.HasSuffix(got, ",2,10,87s") {
+		t.Errorf("rollout without interval: %q", got)
+	}
+}
+
+func TestChunkStore(t *testing.T) {
+	freshStores()
+	image := func(fill ...byte) *firmware {
+		fw := &firmware{}
+		for _, b := range fill {
+			fw.data = append(fw.data, bytes.Repeat([]byte{b}, 64)...)
+		}
+		return fw
+	}
+	a, b := image(101, 102, 103, 101), image(101, 102, 104)
+	if fresh := a.prepare(); fresh != 3 {
+		t.Errorf("first image: %d new chunks", fresh)
+	}
+	if fresh := b.prepare(); fresh != 1 || b.chunks[0] != a.chunks[0] {
+		t.Errorf("second image: %d new chunks", fresh)
+	}
+	if len(chunkStore.m) != 4 || a.size != 256 || a.data != nil {
+		t.Errorf("stored %d chunks, size %d", len(chunkStore.m), a.size)
+	}
+	if got := a.bytes(); !bytes.Equal(got, image(101, 102, 103, 101).data) {
+		t.Errorf("image not restored: %v", got)
+	}
+
+	var store firmwareStore
+	store.publish("c.hex", a)
+	store.publish("c.hex", b) // drops chunk 103, the others are used by b
+	if len(chunkStore.m) != 3 {
+		t.Errorf("after replacing: %d chunks", len(chunkStore.m))
+	}
+	got := string(a.appendDownloadCmd(nil, 1001, 2, hdrDst|17))
+	if !strings.HasPrefix(got, "235,3,103,") {
+		t.Errorf("released chunk no longer usable: %q", got)
+	}
+}
+
+// applyDelta applies delta ops the way the boot loader does, in place, and
+// page by page, so copies from pages written before the last one read the new
+// content.
+func applyDelta(flash, ops []byte) []byte {
+	var page, last [deltaPage]byte
+	out := 0
+	put := func(b byte) {
+		page[out%deltaPage] = b
+		if out++; out%deltaPage == 0 {
+			for len(flash) < out {
+				flash = append(flash, 0xFF)
+			}
+			copy(last[:], flash[out-deltaPage:])
+			copy(flash[out-deltaPage:], page[:])
+		}
+	}
+	read := func(src int) byte {
+		if start := out&^(deltaPage-1) - deltaPage; src >= start && src < start+deltaPage {
+			return last[src-start]
+		}
+		return flash[src]
+	}
+	for i := 0; ops[i] != deltaEnd; {
+		switch ops[i] {
+		case deltaLit:
+			n := int(get16(ops[i+1:]))
+			for _, b := range ops[i+3 : i+3+n] {
+				put(b)
+			}
+			i += 3 + n
+		case deltaCopy:
+			src, n := int(get16(ops[i+1:])), int(get16(ops[i+3:]))
+			for j := 0; j < n; j++ {
+				put(read(src + j))
+			}
+			i += 5
+		case deltaRun:
+			for j := 0; j < int(get16(ops[i+2:])); j++ {
+				put(ops[i+1])
+			}
+			i += 4
+		}
+	}
+	if out%deltaPage != 0 {
+		for len(flash) < out {
+			flash = append(flash, 0xFF)
+		}
+		copy(flash[out-out%deltaPage:], page[:out%deltaPage])
+	}
+	return flash[:out]
+}
+
+func TestDelta(t *testing.T) {
+	freshStores()
+	old := make([]byte, 4096)
+	for i := range old {
+		old[i] = byte(i*i>>3 + i>>5)
+	}
+	// a small change, code moved down by an insert, and a moved up block
+	cur := append([]byte(nil), old[:1000]...)
+	cur[500] ^= 0xFF
+	cur = append(cur, 1, 2, 3)
+	cur = append(cur, old[1000:2000]...)
+	cur = append(cur, old[3000:]...)
+	cur = append(cur, make([]byte, 200)...)
+	cur = append(cur, old[2000:2061]...)
+	cur = cur[:len(cur)&^63]
+
+	ops := makeDelta(old, cur)
+	if ops == nil || len(ops) > 2*chunkSize {
+		t.Fatalf("delta size: %d", len(ops))
+	}
+	if got := applyDelta(append([]byte(nil), old...), ops); !bytes.Equal(got, cur) {
+		t.Errorf("delta applied in place differs")
+	}
+	if ops := makeDelta(old, bytes.Repeat([]byte{7, 13, 29}, 1000)); ops != nil {
+		t.Errorf("delta of unrelated image: %d bytes", len(ops))
+	}
+
+	bootConfig.publish(config{
+		SwIDs: map[string]string{"1000": "d1.hex", "1006": "d2.hex"},
+		HwIDs: map[string]hwEntry{
+			"000000000000000000000000000000b1": {2, 212, 24, 1006},
+		},
+	})
+	publishImage("d1.hex", old, 0x1111)
+	publishImage("d2.hex", cur, 0x2222)
+	w := JeeBoot{group: 212}
+	upgrade := []byte{0xA0 | 24, 0, 2, 232, 3, 0, 1, 0x11, 0x11, upgradeDelta}
+	got := string(w.respondToRequest(upgrade, nil))
+	if !strings.HasSuffix(got, fmt.Sprintf(",%d,%d,0,88s", upgradeDelta, len(ops)/64)) {
+		t.Errorf("delta upgrade reply: %q", got)
+	}
+	got = string(w.respondToRequest([]byte{0xA0 | 24, 238, 3, 0, 0}, nil))
+	if !strings.HasPrefix(got, fmt.Sprintf("238,3,%d,", deltaCopy)) ||
+		!strings.HasSuffix(got, ",88s") { // the ops, not the image
+		t.Errorf("first delta chunk: %q", got)
+	}
+	// after a restart without the journal, image chunks would corrupt the node
+	sessions.mu.Lock()
+	delete(sessions.m, nodeKey{212, 24})
+	sessions.mu.Unlock()
+	if got := string(w.respondToRequest([]byte{0xA0 | 24, 238, 3, 1, 0}, nil)); got != "" {
+		t.Errorf("download without a session: %q", got)
+	}
+	upgrade[7] = 0x12 // not the image the server has
+	if got := string(w.respondToRequest(upgrade, nil)); !strings.HasSuffix(got, ",0,88s") {
+		t.Errorf("full upgrade reply: %q", got)
+	}
+}
+
+func TestBroadcast(t *testing.T) {
+	freshStores()
+	bootConfig.publish(config{
+		SwIDs: map[string]string{"1006": "bc2.hex", "1007": "bc.hex"},
+		HwIDs: map[string]hwEntry{
+			"000000000000000000000000000000c1": {2, 212, 25, 1007},
+			"000000000000000000000000000000c2": {2, 212, 26, 1007},
+			"000000000000000000000000000000c3": {2, 212, 27, 1006},
+			"000000000000000000000000000000c4": {2, 212, 28, 1007},
+		},
+		Broadcast: 20,
+	})
+	fw := publishImage("bc.hex", make([]byte, 12*64), 0x3333)
+	publishImage("bc2.hex", make([]byte, 4*64), 0x4444)
+
+	var out sentCmds
+	w := JeeBoot{group: 212, Out: &out}
+	for _, node := range []uint8{25, 26} {
+		req := []byte{0xA0 | node, 0, 2, 0, 0, 0, 0, 0, 0, upgradeBcast | upgradePush}
+		got := string(w.respondToRequest(req, nil))
+		if !strings.HasSuffix(got, fmt.Sprintf(",%d,%ds", upgradeBcast, hdrDst|node)) {
+			t.Errorf("upgrade reply to %d: %q", node, got)
+		}
+	}
+	// chunks of two images can't be told apart, so one session per group
+	req := []byte{0xA0 | 27, 0, 2, 0, 0, 0, 0, 0, 0, upgradeBcast}
+	if got := string(w.respondToRequest(req, nil)); !strings.HasSuffix(got, ",0,91s") {
+		t.Errorf("second image in the group: %q", got)
+	}
+	if len(w.bcasts) != 1 || len(w.streams) != 0 {
+		t.Fatalf("sessions: %d broadcast, %d streams", len(w.bcasts), len(w.streams))
+	}
+	// a reloaded image doesn't replace the one the session started with
+	publishImage("bc.hex", bytes.Repeat([]byte{7}, 12*64), 0x3434)
+	req = []byte{0xA0 | 28, 0, 2, 0, 0, 0, 0, 0, 0, upgradeBcast}
+	if got := string(w.respondToRequest(req, nil)); !strings.HasSuffix(got, ",52,52,0,92s") {
+		t.Errorf("upgrade to the reloaded image: %q", got)
+	}
+	if s := w.bcasts[bcastKey{212, 1007, false}]; s == nil || s.fw != fw {
+		t.Fatalf("session image replaced")
+	}
+
+	sent := func(n int) []uint16 {
+		out = out[:0]
+		now := time.Now()
+		for i := 0; i < n; i++ {
+			w.broadcastChunks(now)
+		}
+		var sent []uint16
+		for _, m := range out {
+			if s, ok := m.(string); ok {
+				if !strings.HasSuffix(s, ",0s") {
+					t.Errorf("not a broadcast: %q", s)
+				}
+				v := strings.Split(s, ",")
+				lo, _ := strconv.Atoi(v[0])
+				hi, _ := strconv.Atoi(v[1])
+				sent = append(sent, uint16(lo|hi<<8)^1007)
+			}
+		}
+		return sent
+	}
+	if got := sent(20); len(got) != 12 || got[0] != 0 || got[11] != 11 {
+		t.Errorf("first round: %v", got)
+	}
+	// both nodes missed chunk 3, and each missed one more
+	w.respondToRequest([]byte{0xA0 | 25, 239, 3, 0, 0, 0x08 | 0x20, 0, 0, 0, 0, 0, 0, 0}, nil)
+	w.respondToRequest([]byte{0xA0 | 26, 239, 3, 8, 0, 0x02, 0, 0, 0, 0, 0, 0, 0}, nil)
+	w.respondToRequest([]byte{0xA0 | 26, 239, 3, 0, 0, 0x08, 0, 0, 0, 0, 0, 0, 0}, nil)
+	// a node downloading the reloaded image gets no say in the session
+	w.respondToRequest([]byte{0xA0 | 28, 239, 3, 0, 0, 0x01, 0, 0, 0, 0, 0, 0, 0}, nil)
+	if got := sent(20); fmt.Sprint(got) != "[3 5 9]" {
+		t.Errorf("merged repairs: %v", got)
+	}
+	w.bcasts[bcastKey{212, 1007, false}].last = time.Now().Add(-bcastIdle - time.Second)
+	if sent(1); len(w.bcasts) != 0 {
+		t.Errorf("idle session not ended")
+	}
+}
+
+// ltDecoder does what the boot loader does with coded symbols: pending ones
+// are parked in the flash slot of one of their missing chunks, and a table of
+// at most ltMaxPending seeds is all it keeps in RAM.
+type ltDecoder struct {
+	k      int
+	flash  [][chunkSize]byte
+	have   []bool
+	parked []bool
+	pend   [][2]uint16 // seed, slot
+	nHave  int
+}
+
+const ltMaxPending = 32
+
+func newLtDecoder(k int) *ltDecoder {
+	return &ltDecoder{k: k, flash: make([][chunkSize]byte, k),
+		have: make([]bool, k), parked: make([]bool, k)}
+}
+
+func (d *ltDecoder) xorDecoded(buf *[chunkSize]byte, neighbors []uint16) {
+	for _, c := range neighbors {
+		if d.have[c] {
+			for j := range buf {
+				buf[j] ^= d.flash[c][j]
+			}
+		}
+	}
+}
+
+func (d *ltDecoder) missing(neighbors []uint16) (n int, last uint16) {
+	for _, c := range neighbors {
+		if !d.have[c] {
+			n, last = n+1, c
+		}
+	}
+	return
+}
+
+// decoded stores chunk c, after moving a symbol parked in its slot.
+func (d *ltDecoder) decoded(c uint16, buf [chunkSize]byte) {
+	if d.parked[c] {
+		e := 0
+		for d.pend[e][1] != c {
+			e++
+		}
+		d.parked[c] = false
+		moved := false
+		for _, n := range ltNeighbors(d.pend[e][0], d.k, nil) {
+			if n != c && !d.have[n] && !d.parked[n] {
+				d.flash[n] = d.flash[c]
+				d.parked[n] = true
+				d.pend[e][1] = n
+				moved = true
+				break
+			}
+		}
+		if !moved {
+			d.pend[e] = d.pend[len(d.pend)-1]
+			d.pend = d.pend[:len(d.pend)-1]
+		}
+	}
+	d.flash[c] = buf
+	d.have[c] = true
+	d.nHave++
+}
+
+// sweep decodes pending symbols with only their own slot still missing.
+func (d *ltDecoder) sweep() {
+	for e := 0; e < len(d.pend); {
+		neighbors := ltNeighbors(d.pend[e][0], d.k, nil)
+		if n, _ := d.missing(neighbors); n > 1 {
+			e++
+			continue
+		}
+		s := d.pend[e][1]
+		buf := d.flash[s]
+		d.xorDecoded(&buf, neighbors)
+		d.pend[e] = d.pend[len(d.pend)-1]
+		d.pend = d.pend[:len(d.pend)-1]
+		d.parked[s] = false
+		d.decoded(s, buf)
+		e = 0
+	}
+}
+
+func (d *ltDecoder) receive(seed uint16, buf [chunkSize]byte) {
+	neighbors := ltNeighbors(seed, d.k, nil)
+	switch n, last := d.missing(neighbors); {
+	case n == 1:
+		d.xorDecoded(&buf, neighbors)
+		d.decoded(last, buf)
+		d.sweep()
+	case n > 1 && len(d.pend) < ltMaxPending:
+		for _, c := range neighbors {
+			if !d.have[c] && !d.parked[c] {
+				d.flash[c] = buf
+				d.parked[c] = true
+				d.pend = append(d.pend, [2]uint16{seed, c})
+				break
+			}
+		}
+	}
+}
+
+func TestCoded(t *testing.T) {
+	freshStores()
+	bootConfig.publish(config{
+		SwIDs: map[string]string{"1008": "lt.hex"},
+		HwIDs: map[string]hwEntry{
+			"000000000000000000000000000000d1": {2, 212, 27, 1008},
+			"000000000000000000000000000000d2": {2, 212, 28, 1008},
+		},
+		Broadcast: 20,
+		Coded:     true,
+	})
+	data := make([]byte, 40*64)
+	for i := range data {
+		data[i] = uint8(i*7 + i>>6)
+	}
+	publishImage("lt.hex", data, 0x4444)
+
+	var out sentCmds
+	w := JeeBoot{group: 212, Out: &out}
+	upgrade := func(node, flags uint8) string {
+		req := []byte{0xA0 | node, 0, 2, 0, 0, 0, 0, 0, 0, flags}
+		return string(w.respondToRequest(req, nil))
+	}
+	if got := upgrade(27, upgradeBcast|upgradeCoded); !strings.HasSuffix(got,
+		fmt.Sprintf(",%d,%ds", upgradeBcast|upgradeCoded, hdrDst|27)) {
+		t.Errorf("coded upgrade reply: %q", got)
+	}
+	// a node without the decoder can't share the group's coded session
+	if got := upgrade(28, upgradeBcast); !strings.HasSuffix(got, fmt.Sprintf(",0,%ds", hdrDst|28)) {
+		t.Errorf("plain upgrade reply: %q", got)
+	}
+	s := w.bcasts[bcastKey{212, 1008, true}]
+	if len(w.bcasts) != 1 || s == nil || s.left != codedSpan*40 {
+		t.Fatalf("sessions: %v", w.bcasts)
+	}
+
+	// lose every third symbol, the node must still get the whole image
+	d := newLtDecoder(40)
+	out = out[:0]
+	for i := 0; d.nHave < 40 && i < codedSpan*40; i++ {
+		w.broadcastChunks(time.Now())
+		if i%3 == 2 {
+			continue
+		}
+		v := strings.Split(out[len(out)-1].(string), ",")
+		lo, _ := strconv.Atoi(v[0])
+		hi, _ := strconv.Atoi(v[1])
+		var sym [chunkSize]byte
+		for j := range sym {
+			b, _ := strconv.Atoi(v[2+j])
+			sym[j] = uint8(b) ^ uint8(211*j)
+		}
+		d.receive(uint16(lo|hi<<8)^1008, sym)
+	}
+	var got []byte
+	for _, c := range d.flash {
+		got = append(got, c[:]...)
+	}
+	if d.nHave < 40 || !bytes.Equal(got, data) {
+		t.Fatalf("decoded %d chunks, after %d symbols", d.nHave, s.seed)
+	}
+
+	// joining again keeps the session going, it ends once all are sent
+	upgrade(27, upgradeBcast|upgradeCoded)
+	if s.left != codedSpan*40 {
+		t.Errorf("not extended: %d left", s.left)
+	}
+	for i := 0; i < codedSpan*40; i++ {
+		w.broadcastChunks(time.Now())
+	}
+	s.last = time.Now().Add(-bcastIdle - time.Second)
+	if w.broadcastChunks(time.Now()); len(w.bcasts) != 0 {
+		t.Errorf("coded session not ended, %d left", s.left)
+	}
+}
+
+func TestJournal(t *testing.T) {
+	freshStores()
+	dir, err := ioutil.TempDir("", "jeeboot")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	path := filepath.Join(dir, "state")
+	saved := bootState
+	defer func() { bootState = saved }()
+	bootState = &journal{live: map[string]journalEntry{}}
+	if err := bootState.load(path); err != nil {
+		t.Fatal(err)
+	}
+
+	bootConfig.publish(config{
+		SwIDs: map[string]string{"1009": "jn.hex", "1010": "jo.hex"},
+		HwIDs: map[string]hwEntry{
+			"000000000000000000000000000000e1": {2, 77, 3, 1009},
+			"000000000000000000000000000000e2": {2, 77, 5, 1009},
+		},
+		Broadcast: 20,
+		Coded:     true,
+	})
+	old := make([]byte, 20*64)
+	for i := range old {
+		old[i] = uint8(i * 13)
+	}
+	cur := append([]byte(nil), old...)
+	cur[100], cur[1000] = 1, 2
+	publishImage("jo.hex", old, 0x5555)
+	fw := publishImage("jn.hex", cur, 0x6666)
+
+	// a delta download, and a hardware ID handed out
+	w := JeeBoot{group: 77, Out: &sentCmds{}}
+	upgrade := []byte{0xA0 | 3, 0, 2, 0xF2, 0x03, 80, 0, 0x55, 0x55, upgradeDelta}
+	if got := string(w.respondToRequest(upgrade, nil)); !strings.Contains(got,
+		fmt.Sprintf(",%d,1,0,67s", upgradeDelta)) {
+		t.Fatalf("delta upgrade reply: %q", got)
+	}
+	download := []byte{0xA0 | 3, 0xF1, 0x03, 0, 0}
+	want := string(w.respondToRequest(download, nil))
+	w.respondToRequest([]byte{0xA0 | 5, 0, 2, 0xF2, 0x03, 80, 0, 0x55, 0x55}, nil)
+	w.group = pairingGroup
+	w.respondToRequest(append([]byte{0xA0, 0, 2, 0, 0, 0, 0}, make([]byte, 16)...), nil)
+	w.startBroadcast(77, 1009, fw, true, time.Now())
+	if err := bootState.flush(); err != nil {
+		t.Fatal(err)
+	}
+
+	// restart: the delta is rebuilt, for the same download reply
+	sessions.mu.Lock()
+	delete(sessions.m, nodeKey{77, 3})
+	sessions.mu.Unlock()
+	deltaCache.Lock()
+	deltaCache.m = map[[2]*firmware]*firmware{}
+	deltaCache.Unlock()
+	f, _ := os.OpenFile(path, os.O_WRONLY|os.O_APPEND, 0644)
+	f.WriteString(`{"Key":"s:77/4","Sess`) // cut short by a crash
+	f.Close()
+	bootState = &journal{live: map[string]journalEntry{}}
+	if err := bootState.load(path); err != nil {
+		t.Fatal(err)
+	}
+	for _, k := range []string{"s:77/3", "b:77/1009"} {
+		if _, ok := bootState.live[k]; !ok {
+			t.Errorf("%s missing after restart", k)
+		}
+	}
+	if len(bootState.assignments()) != 1 {
+		t.Errorf("assignments after restart: %v", bootState.assignments())
+	}
+	w = JeeBoot{group: 77, Out: &sentCmds{}}
+	if got := string(w.respondToRequest(download, nil)); got != want {
+		t.Errorf("download after restart: %q, want %q", got, want)
+	}
+
+	// the coded broadcast is resumed, a plain one restarts for the repairs
+	w.bcastTicker()
+	if s := w.bcasts[bcastKey{77, 1009, true}]; s == nil || s.left != codedSpan*20 {
+		t.Errorf("coded broadcast not resumed: %v", w.bcasts)
+	}
+	delete(w.bcasts, bcastKey{77, 1009, true})
+	w.respondToRequest([]byte{0xA0 | 5, 0xF1, 0x03, 0, 0, 0x06, 0, 0, 0, 0, 0, 0, 0}, nil)
+	if s := w.bcasts[bcastKey{77, 1009, false}]; s == nil || s.nPending != 2 ||
+		!s.pending[1] || !s.pending[2] {
+		t.Errorf("repairs did not restart the broadcast: %v", w.bcasts)
+	}
+	runTicker(&w.bcastTick, false, 0)
+
+	// the file is compacted once it has grown to twice its live entries
+	for i := 0; i < 2*stateSlack; i++ {
+		bootState.put(journalEntry{Key: "r:1009", Rollout: &rolloutRecord{1009, time.Now(), ""}})
+	}
+	if err := bootState.flush(); err != nil {
+		t.Fatal(err)
+	}
+	data, _ := ioutil.ReadFile(path)
+	if n := bytes.Count(data, []byte("\n")); n != len(bootState.live) {
+		t.Errorf("%d lines after compaction, %d entries", n, len(bootState.live))
+	}
+
+	// thousands of entries load well within a second
+	for i := 0; i < 5000; i++ {
+		id := fmt.Sprintf("%032x", i)
+		bootState.put(journalEntry{Key: "a:" + id, Assign: &assignment{id, 2, time.Now()}})
+	}
+	bootState.flush()
+	bootState = &journal{live: map[string]journalEntry{}}
+	if err := bootState.load(path); err != nil {
+		t.Fatal(err)
+	}
+	if len(bootState.assignments()) != 5001 || bootState.loadTime > time.Second {
+		t.Errorf("loaded %d assignments in %s", len(bootState.assignments()),
+			bootState.loadTime)
+	}
+	bootState.f.Close()
+}
+
+func TestTdma(t *testing.T) {
+	freshStores()
+	bootConfig.publish(config{SwIDs: map[string]string{"1008": "tdma.hex"}, Tdma: 20})
+	fw := publishImage("tdma.hex", make([]byte, 64*chunkSize), 0x7788)
+
+	// five nodes, each with its own delay from reply to next request
+	var out sentCmds
+	w := JeeBoot{group: 212, Out: &out}
+	start := time.Now()
+	const nodes = 5
+	var next [nodes]time.Time
+	var index [nodes]uint16
+	for n := range next {
+		next[n] = start.Add(time.Duration(n) * 3 * time.Millisecond)
+		sessions.upgrade(nodeKey{212, uint8(10 + n)}, 1008, fw, nil, start)
+	}
+	for round := 0; round < nodes*30; round++ {
+		n := 0
+		for i := range next {
+			if next[i].Before(next[n]) {
+				n = i
+			}
+		}
+		node := uint8(10 + n)
+		w.arrival = next[n]
+		w.respondToRequest([]byte{0xA0 | node, 240, 3, byte(index[n]), 0}, nil)
+		due := w.due
+		if due.IsZero() {
+			due = w.arrival
+		} else if due.Sub(w.arrival) > replyWindow {
+			t.Fatalf("node %d: reply held for %v", node, due.Sub(w.arrival))
+		}
+		s := w.slots[nodeKey{212, node}]
+		if s == nil || s.index != n {
+			t.Fatalf("node %d: slot %+v", node, s)
+		}
+		if index[n] > 2 { // latency known, the request must be in its slot
+			frame := time.Duration(w.nSlots) * 20 * time.Millisecond
+			phase := w.arrival.Sub(w.slotEpoch)%frame - time.Duration(n)*20*time.Millisecond
+			if phase < 0 || phase >= 20*time.Millisecond {
+				t.Fatalf("node %d chunk %d: %v into its slot", node, index[n], phase)
+			}
+		}
+		index[n]++
+		next[n] = due.Add(time.Duration(25+2*n) * time.Millisecond)
+	}
+	if w.nSlots != nodes {
+		t.Errorf("slots per frame: %d", w.nSlots)
+	}
+
+	// held replies go out once due, in order
+	w.arrival = time.Time{}
+	now := time.Now()
+	w.holdReply(heldReply{due: now.Add(2 * time.Millisecond), cmd: "b"}, now)
+	w.holdReply(heldReply{due: now.Add(time.Millisecond), cmd: "a"}, now)
+	if w.releaseHeld(now); len(out) != 0 {
+		t.Errorf("sent before due: %q", out)
+	}
+	<-w.holdTimeout()
+	w.releaseHeld(now.Add(2 * time.Millisecond))
+	if len(out) != 4 || out[1] != "a" || out[3] != "b" || w.holdTimeout() != nil {
+		t.Errorf("released: %q", out)
+	}
+
+	w.respondToRequest([]byte{0xA0 | 10, 240, 3, 63, 0}, nil) // last chunk
+	if _, ok := w.slots[nodeKey{212, 10}]; ok || w.nSlots != nodes {
+		t.Errorf("slot not freed: %d slots", w.nSlots)
+	}
 }
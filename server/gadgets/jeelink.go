@@ -0,0 +1,266 @@
+package jeeboot
+
+import (
+	"bufio"
+	"errors"
+	"io"
+	"time"
+
+	"github.com/chimera/rs232"
+	"github.com/golang/glog"
+	"github.com/jcw/flow"
+)
+
+func init() {
+	flow.Registry["JeeLinkBin"] = func() flow.Circuitry { return &JeeLinkBin{} }
+}
+
+// Binary framing to the jeeLinkBin sketch, instead of RF12demo's ASCII. Each
+// frame is: frameStart, length, type, payload..., crc-lo, crc-hi - where the
+// length counts the type and payload bytes, and the crc covers everything
+// from the length up, same CRC-16 as the boot loader (avr-libc _crc16_update).
+const (
+	frameStart = 0xA5
+	frameMax   = 66 + 3 // largest RF12 payload, plus type, group, and hdr
+
+	frameConfig  = 'C' // to gateway: band, group, node ID
+	frameSend    = 'S' // to gateway: group (0 for the radio's), hdr, payload...
+	frameHello   = 'H' // from gateway: version, 0
+	frameReceive = 'R' // from gateway: group, hdr, payload...
+)
+
+var errBadCmd = errors.New("bad send command")
+
+// crc16Update is avr-libc's _crc16_update, i.e. the CRC-16 with poly 0xA001.
+func crc16Update(crc uint16, b byte) uint16 {
+	crc ^= uint16(b)
+	for i := 0; i < 8; i++ {
+		if crc&1 != 0 {
+			crc = crc>>1 ^ 0xA001
+		} else {
+			crc >>= 1
+		}
+	}
+	return crc
+}
+
+// appendFrame appends one frame of the given type, payload in two parts.
+func appendFrame(b []byte, typ byte, p1, p2 []byte) []byte {
+	start := len(b) + 1
+	b = append(b, frameStart, byte(1+len(p1)+len(p2)), typ)
+	b = append(b, p1...)
+	b = append(b, p2...)
+	crc := uint16(0xFFFF)
+	for _, v := range b[start:] {
+		crc = crc16Update(crc, v)
+	}
+	return append16(b, crc)
+}
+
+// frameReader splits a byte stream into frames, skipping anything corrupt.
+type frameReader struct {
+	r   *bufio.Reader
+	buf [frameMax + 3]byte
+	bad int // number of frames dropped due to a bad length or crc
+}
+
+// next returns the type and payload of the next good frame. The payload is
+// only valid until the following call.
+func (f *frameReader) next() (byte, []byte, error) {
+	for {
+		b, err := f.r.ReadByte()
+		if err != nil {
+			return 0, nil, err
+		}
+		if b != frameStart {
+			continue
+		}
+		n, err := f.r.ReadByte()
+		if err != nil {
+			return 0, nil, err
+		}
+		if n < 1 || n > frameMax {
+			f.bad++
+			continue
+		}
+		// peek instead of read: after a bad crc, the search for the next start
+		// byte resumes right after the length byte, since the length may have
+		// been a stray byte, and the real frame may start inside this one
+		data, err := f.r.Peek(int(n) + 2)
+		if err != nil {
+			return 0, nil, err
+		}
+		crc := crc16Update(0xFFFF, n)
+		for _, v := range data {
+			crc = crc16Update(crc, v)
+		}
+		if crc != 0 { // the crc over the data plus its own crc is zero
+			f.bad++
+			continue
+		}
+		copy(f.buf[:], data[:n])
+		f.r.Discard(int(n) + 2)
+		return f.buf[0], f.buf[1:n], nil
+	}
+}
+
+// parseSendCmd converts an RF12demo send command such as "1,2,3,81s" into the
+// payload and the header value, where the last number is the header.
+func parseSendCmd(cmd string, payload []byte) (byte, []byte, error) {
+	payload = payload[:0]
+	var v int
+	digits := 0
+	for i := 0; i < len(cmd); i++ {
+		switch c := cmd[i]; {
+		case c >= '0' && c <= '9':
+			v = 10*v + int(c-'0')
+			digits++
+			if v > 255 {
+				return 0, nil, errBadCmd
+			}
+		case (c == ',' || c == 's') && digits > 0:
+			if c == 's' {
+				if i != len(cmd)-1 {
+					return 0, nil, errBadCmd
+				}
+				return byte(v), payload, nil
+			}
+			payload = append(payload, byte(v))
+			v, digits = 0, 0
+		default:
+			return 0, nil, errBadCmd
+		}
+	}
+	return 0, nil, errBadCmd
+}
+
+// rf12Band returns the RF12 band code for a frequency band in MHz.
+func rf12Band(band int) byte {
+	switch band {
+	case 433:
+		return 1
+	case 915:
+		return 3
+	}
+	return 2 // 868 MHz
+}
+
+// JeeLinkBin talks to a JeeLink or JeeNode running the jeeLinkBin sketch, and
+// replaces the SerialPort + RF12demo pair. Boot requests come out on Oob,
+// preceded by a "<group>" tag as for RF12demo, and an "<arrival>" time tag. All other
+// packets go to Out, as [group, hdr, payload...]. Send commands on In use the
+// RF12demo syntax, i.e. "1,2,3,81s", so the rest of the pipeline is the same.
+// A "<group>" tag before a command sends it on that group, which a gateway
+// listening on all groups needs: RF12demo can't do this.
+// The Port is a device name, Baud defaults to 500000 and must match the
+// sketch. Band (in MHz) and Group (0 for all) set up the radio.
+type JeeLinkBin struct {
+	flow.Gadget
+	Port  flow.Input
+	Baud  flow.Input
+	Band  flow.Input
+	Group flow.Input
+	In    flow.Input
+	Oob   flow.Output
+	Out   flow.Output
+}
+
+// Start talking to the gateway, this ends when the input is closed.
+func (g *JeeLinkBin) Run() {
+	dev := (<-g.Port).(string)
+	baud, band, group := 500000, 868, 212
+	if m, ok := <-g.Baud; ok {
+		baud = m.(int)
+	}
+	if m, ok := <-g.Band; ok {
+		band = m.(int)
+	}
+	if m, ok := <-g.Group; ok {
+		group = m.(int)
+	}
+
+	port, err := rs232.Open(dev, rs232.Options{
+		BitRate: uint32(baud), DataBits: 8, StopBits: 1,
+	})
+	flow.Check(err)
+	defer port.Close()
+
+	go g.readFrames(port)
+
+	// all frames go through a write queue, which combines them when busy
+	q := newWriteQueue(dev, "")
+	done := make(chan struct{})
+	go func() {
+		err := q.drain(func(b []byte) error {
+			_, err := port.Write(b)
+			return err
+		}, nil)
+		if err != nil {
+			glog.Errorln("jeelink:", err)
+		}
+		close(done)
+	}()
+
+	frame := appendFrame(nil, frameConfig,
+		[]byte{rf12Band(band), byte(group), 31}, nil)
+	q.push(queuedWrite{data: frame, queued: time.Now()})
+
+	var payload [maxReplySize]byte
+	var deadline time.Time // of the next command
+	var sendGroup byte     // of the next command
+	for m := range g.In {
+		if t, ok := m.(flow.Tag); ok && t.Tag == "<deadline>" {
+			deadline = t.Msg.(time.Time)
+			continue
+		}
+		if t, ok := m.(flow.Tag); ok && t.Tag == "<group>" {
+			sendGroup = byte(t.Msg.(int))
+			continue
+		}
+		cmd, ok := m.(string)
+		if !ok {
+			continue // e.g. RF12demo's reset request, not needed here
+		}
+		hdr, data, err := parseSendCmd(cmd, payload[:0])
+		if err != nil {
+			glog.Warningf("jeelink: %v: %q", err, cmd)
+			continue
+		}
+		frame = appendFrame(frame[:0], frameSend, []byte{sendGroup, hdr}, data)
+		q.push(queuedWrite{data: frame, queued: time.Now(), deadline: deadline,
+			bulk: isBulk(cmd)})
+		deadline, sendGroup = time.Time{}, 0
+	}
+	q.close()
+	<-done
+}
+
+// readFrames passes on all received packets, until the port fails.
+func (g *JeeLinkBin) readFrames(port io.Reader) {
+	f := frameReader{r: bufio.NewReader(port)}
+	group := -1
+	for {
+		typ, data, err := f.next()
+		if err != nil {
+			glog.Errorln("jeelink:", err)
+			return
+		}
+		arrival := time.Now()
+		switch {
+		case typ == frameHello && len(data) > 0:
+			glog.Infof("jeelink: sketch version %d, %d bad frames", data[0], f.bad)
+		case typ == frameReceive && len(data) >= 2:
+			// boot requests have both the CTL and the ACK bit set
+			if data[1]&0xA0 == 0xA0 {
+				if int(data[0]) != group {
+					group = int(data[0])
+					g.Oob.Send(groupTag(group))
+				}
+				g.Oob.Send(arrivalTag(arrival))
+				g.Oob.Send(append([]byte(nil), data[1:]...))
+			} else {
+				g.Out.Send(append([]byte(nil), data...))
+			}
+		}
+	}
+}
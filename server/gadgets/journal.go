@@ -0,0 +1,379 @@
+package jeeboot
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/json"
+	"fmt"
+	"io"
+	"os"
+	"sort"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/golang/glog"
+	"github.com/jcw/flow"
+)
+
+// The server state which nodes rely on, i.e. the hardware IDs handed out, the
+// sessions with their stats, rollout start times, and coded broadcasts, is
+// kept in a journal file, so that a restart does not send nodes back to the
+// start of their download. Each change is appended as a line of JSON with a
+// key, the last line for a key wins, and a line without a value deletes it.
+// Changes are written once per stateFlush, sessions only if they changed. On
+// load, and when the file holds more than twice as many lines as there are
+// live keys, it is rewritten with one line per key.
+const (
+	stateFlush   = 1 * time.Second
+	stateSlack   = 1000             // lines allowed beyond twice the live keys
+	stateRestore = 10 * time.Minute // older broadcasts are not resumed
+)
+
+func init() {
+	flow.Registry["BootState"] = func() flow.Circuitry { return &BootState{} }
+}
+
+// journalEntry is one line of the journal, at most one of the values is set.
+type journalEntry struct {
+	Key     string
+	Assign  *assignment    `json:",omitempty"`
+	Session *sessionRecord `json:",omitempty"`
+	Rollout *rolloutRecord `json:",omitempty"`
+	Bcast   *bcastRecord   `json:",omitempty"`
+}
+
+func (e *journalEntry) deleted() bool {
+	return e.Assign == nil && e.Session == nil && e.Rollout == nil && e.Bcast == nil
+}
+
+// assignment is a hardware ID handed out to a node which had none.
+type assignment struct {
+	HwID  string
+	Board uint8
+	Time  time.Time
+}
+
+// sessionRecord is what the journal keeps of a session. The image is looked
+// up again by its crc, and a delta by the image it applies to.
+type sessionRecord struct {
+	session
+	Crc  uint16
+	Base *upgradeRequest `json:",omitempty"`
+}
+
+// rolloutRecord is the start of a rollout, the waves open relative to it, as
+// long as its plan, i.e. its config, stays the same.
+type rolloutRecord struct {
+	SwID  uint16
+	Start time.Time
+	Plan  string
+}
+
+// bcastRecord is a coded broadcast session. The nodes in it never send
+// anything, so it has to be resumed without them.
+type bcastRecord struct {
+	Group uint8
+	SwID  uint16
+	Crc   uint16
+	Time  time.Time // started or extended
+}
+
+// journal holds the live entries, and the file they are written to. Entries
+// are encoded with mu held, but the file is written and synced without it, so
+// that put never waits for the disk. fileMu serializes the writers, it is
+// taken before mu.
+type journal struct {
+	mu      sync.Mutex
+	fileMu  sync.Mutex
+	f       *os.File // the journal file, written with fileMu held
+	path    string   // empty until loaded, changes are then only kept in memory
+	live    map[string]journalEntry
+	pending []journalEntry
+	lines   int // in the file
+
+	bcasts  []bcastRecord // loaded, not resumed by a JeeBoot gadget yet
+	nBcasts int32         // len(bcasts), read without the lock
+
+	loadTime time.Duration
+}
+
+// bootState is shared by all JeeBoot gadgets and the BootState gadget.
+var bootState = &journal{live: map[string]journalEntry{}}
+
+// put records a change, an entry without a value deletes the key.
+func (j *journal) put(e journalEntry) {
+	j.mu.Lock()
+	if e.deleted() {
+		delete(j.live, e.Key)
+	} else {
+		j.live[e.Key] = e
+	}
+	if j.path != "" {
+		j.pending = append(j.pending, e)
+	}
+	j.mu.Unlock()
+}
+
+// load replays the journal file and restores its state, then compacts the
+// file and keeps it open for appending. A missing file is created.
+func (j *journal) load(path string) error {
+	start := time.Now()
+	live := map[string]journalEntry{}
+	f, err := os.Open(path)
+	switch {
+	case err == nil:
+		err = replay(f, path, live)
+		f.Close()
+		if err != nil {
+			return err
+		}
+	case !os.IsNotExist(err):
+		return err
+	}
+
+	var bcasts []bcastRecord
+	for _, e := range live {
+		switch {
+		case e.Session != nil:
+			sessions.restore(e.Session)
+		case e.Rollout != nil:
+			restoreRollout(e.Rollout)
+		case e.Bcast != nil && time.Since(e.Bcast.Time) < stateRestore:
+			bcasts = append(bcasts, *e.Bcast)
+		}
+	}
+
+	j.fileMu.Lock()
+	defer j.fileMu.Unlock()
+	j.mu.Lock()
+	for k, e := range live {
+		if _, ok := j.live[k]; !ok { // changes since startup win
+			j.live[k] = e
+		}
+	}
+	j.bcasts = append(j.bcasts, bcasts...)
+	atomic.StoreInt32(&j.nBcasts, int32(len(j.bcasts)))
+	j.path = path
+	j.loadTime = time.Since(start)
+	j.mu.Unlock()
+	n, err := j.compact()
+	if err != nil {
+		return err
+	}
+	glog.Infof("state journal %s: %d entries, loaded in %s", path, n,
+		time.Since(start))
+	return nil
+}
+
+// replay applies all lines of a journal file to live.
+func replay(r io.Reader, path string, live map[string]journalEntry) error {
+	scanner := bufio.NewScanner(r)
+	for n := 1; scanner.Scan(); n++ {
+		var e journalEntry
+		if err := json.Unmarshal(scanner.Bytes(), &e); err != nil {
+			// most likely cut short by a crash, the lines before it are fine
+			glog.Warningf("%s:%d: %v", path, n, err)
+			continue
+		}
+		if e.deleted() {
+			delete(live, e.Key)
+		} else {
+			live[e.Key] = e
+		}
+	}
+	return scanner.Err()
+}
+
+// compact writes all live entries to a new file, which then replaces the
+// journal, and returns the number of entries. Changes made while the file is
+// written stay pending. Must be called with fileMu held.
+func (j *journal) compact() (int, error) {
+	j.mu.Lock()
+	keys := make([]string, 0, len(j.live))
+	for k := range j.live {
+		keys = append(keys, k)
+	}
+	sort.Strings(keys)
+	var buf bytes.Buffer
+	enc := json.NewEncoder(&buf)
+	for _, k := range keys {
+		e := j.live[k]
+		if err := enc.Encode(&e); err != nil {
+			j.mu.Unlock()
+			return 0, err
+		}
+	}
+	done := len(j.pending)
+	j.mu.Unlock()
+
+	tmp := j.path + ".tmp"
+	f, err := os.Create(tmp)
+	if err != nil {
+		return 0, err
+	}
+	_, err = f.Write(buf.Bytes())
+	if err == nil {
+		err = f.Sync()
+	}
+	if cerr := f.Close(); err == nil {
+		err = cerr
+	}
+	if err == nil {
+		err = os.Rename(tmp, j.path)
+	}
+	if err != nil {
+		os.Remove(tmp)
+		return 0, err
+	}
+	f, err = os.OpenFile(j.path, os.O_WRONLY|os.O_APPEND, 0644)
+
+	j.mu.Lock()
+	if j.f != nil {
+		j.f.Close()
+	}
+	j.f = f
+	j.lines = len(keys)
+	j.pending = append(j.pending[:0], j.pending[done:]...)
+	if err != nil {
+		j.path, j.pending = "", nil // only kept in memory from now on
+	}
+	j.mu.Unlock()
+	return len(keys), err
+}
+
+// flush appends the changes since the last flush, including the sessions which
+// changed, and compacts the file once it has grown too much.
+func (j *journal) flush() error {
+	for _, r := range sessions.changed() {
+		r := r
+		j.put(journalEntry{Key: fmt.Sprintf("s:%d/%d", r.Group, r.Node), Session: &r})
+	}
+	j.fileMu.Lock()
+	defer j.fileMu.Unlock()
+	j.mu.Lock()
+	if j.f == nil || len(j.pending) == 0 {
+		j.mu.Unlock()
+		return nil
+	}
+	if j.lines+len(j.pending) > 2*len(j.live)+stateSlack {
+		j.mu.Unlock()
+		_, err := j.compact()
+		return err
+	}
+	var buf []byte
+	for i := range j.pending {
+		b, err := json.Marshal(&j.pending[i])
+		if err != nil {
+			j.mu.Unlock()
+			return err
+		}
+		buf = append(append(buf, b...), '\n')
+	}
+	j.lines += len(j.pending)
+	j.pending = j.pending[:0]
+	f := j.f
+	j.mu.Unlock()
+	if _, err := f.Write(buf); err != nil {
+		return err
+	}
+	return f.Sync()
+}
+
+// assignments returns the hardware IDs handed out, oldest first.
+func (j *journal) assignments() []assignment {
+	var list []assignment
+	j.mu.Lock()
+	for _, e := range j.live {
+		if e.Assign != nil {
+			list = append(list, *e.Assign)
+		}
+	}
+	j.mu.Unlock()
+	sort.Sort(byTime(list))
+	return list
+}
+
+type byTime []assignment
+
+func (a byTime) Len() int           { return len(a) }
+func (a byTime) Swap(i, j int)      { a[i], a[j] = a[j], a[i] }
+func (a byTime) Less(i, j int) bool { return a[i].Time.Before(a[j].Time) }
+
+// takeBroadcasts removes and returns the loaded coded broadcasts in the groups
+// a gadget listens to. Those which can't be resumed yet must be handed back.
+func (j *journal) takeBroadcasts(listensTo func(uint8) bool) []bcastRecord {
+	if atomic.LoadInt32(&j.nBcasts) == 0 {
+		return nil
+	}
+	j.mu.Lock()
+	defer j.mu.Unlock()
+	var taken []bcastRecord
+	list := j.bcasts[:0]
+	for _, r := range j.bcasts {
+		switch {
+		case time.Since(r.Time) > stateRestore:
+			// too late, the nodes have given up on it
+		case listensTo(r.Group):
+			taken = append(taken, r)
+		default:
+			list = append(list, r)
+		}
+	}
+	j.bcasts = list
+	atomic.StoreInt32(&j.nBcasts, int32(len(list)))
+	return taken
+}
+
+// returnBroadcasts hands back coded broadcasts which could not be resumed yet.
+func (j *journal) returnBroadcasts(list []bcastRecord) {
+	if len(list) > 0 {
+		j.mu.Lock()
+		j.bcasts = append(j.bcasts, list...)
+		atomic.StoreInt32(&j.nBcasts, int32(len(j.bcasts)))
+		j.mu.Unlock()
+	}
+}
+
+// writeMetrics writes the journal size and load time, Prometheus style.
+func (j *journal) writeMetrics(w io.Writer) {
+	j.mu.Lock()
+	live, lines, load := len(j.live), j.lines, j.loadTime
+	j.mu.Unlock()
+	fmt.Fprintf(w, "# HELP jeeboot_state_entries Live entries in the state journal.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_state_entries gauge\n")
+	fmt.Fprintf(w, "jeeboot_state_entries %d\n", live)
+	fmt.Fprintf(w, "# HELP jeeboot_state_lines Lines in the state journal file.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_state_lines gauge\n")
+	fmt.Fprintf(w, "jeeboot_state_lines %d\n", lines)
+	fmt.Fprintf(w, "# HELP jeeboot_state_load_seconds Time taken to load the state journal.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_state_load_seconds gauge\n")
+	fmt.Fprintf(w, "jeeboot_state_load_seconds %g\n", load.Seconds())
+}
+
+// BootState keeps the server state in a journal file across restarts. Its
+// Path input names the file, an empty path disables the journal.
+type BootState struct {
+	flow.Gadget
+	Path flow.Input
+}
+
+// Load the journal, then write the changes to it from time to time.
+func (g *BootState) Run() {
+	m, ok := <-g.Path
+	path, _ := m.(string)
+	if !ok || path == "" {
+		return
+	}
+	if err := bootState.load(path); err != nil {
+		glog.Errorln("state journal:", err)
+		return
+	}
+	ticker := time.NewTicker(stateFlush)
+	defer ticker.Stop()
+	for range ticker.C {
+		if err := bootState.flush(); err != nil {
+			glog.Errorln("state journal:", err)
+		}
+	}
+}
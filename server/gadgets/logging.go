@@ -0,0 +1,123 @@
+package jeeboot
+
+import (
+	"fmt"
+	"io"
+	"sync/atomic"
+
+	"github.com/golang/glog"
+)
+
+const (
+	logQueueSize   = 256 // events waiting to be written, any more are dropped
+	logSampleEvery = 32  // log one in this many download chunks per node
+)
+
+// Kinds of events logged on the request path.
+type logKind uint8
+
+const (
+	logAssign   logKind = iota // fresh hardware ID handed out
+	logPair                    // pairing reply sent
+	logNoEntry                 // pairing request for an unknown hardware ID
+	logUpgrade                 // upgrade reply sent
+	logDownload                // download chunk sent, sampled
+	logNoData                  // download request past the end of the image
+	logBadReq                  // request of unknown size
+	logReply                   // RF12demo command sent out as reply
+	logNoGroup                 // request without its net group, dropped
+)
+
+var logKindNames = [...]string{
+	"assign", "pair", "no-entry", "upgrade", "download", "no-data", "bad-req",
+	"reply", "no-group",
+}
+
+// logEvent holds the fields of one event, it is only formatted by the sink.
+type logEvent struct {
+	kind                    logKind
+	hdr, board, group, node uint8
+	swID, index             uint16
+	size                    int
+	hwID                    [16]byte
+	text                    string
+}
+
+// String formats an event as key=value pairs, skipping fields not set.
+func (e *logEvent) String() string {
+	s := fmt.Sprintf("event=%s hdr=%08b", logKindNames[e.kind], e.hdr)
+	if e.group != 0 || e.node != 0 {
+		s += fmt.Sprintf(" group=%d node=%d", e.group, e.node)
+	}
+	if e.board != 0 {
+		s += fmt.Sprintf(" board=%d", e.board)
+	}
+	if e.hwID != [16]byte{} {
+		s += fmt.Sprintf(" hwid=%x", e.hwID)
+	}
+	if e.swID != 0 {
+		s += fmt.Sprintf(" swid=%d index=%d", e.swID, e.index)
+	}
+	if e.size != 0 {
+		s += fmt.Sprintf(" size=%d", e.size)
+	}
+	if e.text != "" {
+		s += fmt.Sprintf(" cmd=%q", e.text)
+	}
+	return s
+}
+
+// eventLog passes events to a background sink through a bounded queue. When
+// the sink falls behind, events are dropped and counted instead of blocking
+// the request path.
+type eventLog struct {
+	ch      chan logEvent
+	dropped uint64 // accessed atomically
+}
+
+// bootLog is the event log of all JeeBoot gadgets.
+var bootLog = newEventLog(logQueueSize)
+
+func init() {
+	go bootLog.run()
+}
+
+func newEventLog(size int) *eventLog {
+	return &eventLog{ch: make(chan logEvent, size)}
+}
+
+// add queues an event if its glog verbosity level is enabled, it never blocks.
+func (l *eventLog) add(level glog.Level, e logEvent) {
+	if !glog.V(level) {
+		return
+	}
+	select {
+	case l.ch <- e:
+	default:
+		atomic.AddUint64(&l.dropped, 1)
+	}
+}
+
+// run writes out queued events, bad requests as warnings, all others as info.
+func (l *eventLog) run() {
+	for e := range l.ch {
+		if e.kind == logBadReq || e.kind == logNoEntry || e.kind == logNoGroup {
+			glog.Warningln(e.String())
+		} else {
+			glog.Infoln(e.String())
+		}
+	}
+}
+
+// writeMetrics writes the number of dropped events, Prometheus style.
+func (l *eventLog) writeMetrics(w io.Writer) {
+	fmt.Fprintf(w, "# HELP jeeboot_log_dropped_total Log events dropped.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_log_dropped_total counter\n")
+	fmt.Fprintf(w, "jeeboot_log_dropped_total %d\n", atomic.LoadUint64(&l.dropped))
+}
+
+// sampleChunk returns true for the download chunks of a node worth logging:
+// the first and the last one, and every logSampleEvery-th one in between.
+func sampleChunk(index uint16, chunks int) bool {
+	return index%logSampleEvery == 0 || int(index) == chunks-1
+}
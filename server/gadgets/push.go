@@ -0,0 +1,131 @@
+package jeeboot
+
+import "time"
+
+// Push mode, negotiated in the upgrade exchange (see packet.h): a node which
+// can take a streamed download appends a flags byte with upgradePush to its
+// upgrade request. If the config sets "push", i.e. the number of ms between
+// chunks sent to each node, the reply gets the same flag appended and the
+// download replies are then sent at that rate, without waiting for requests.
+// The node answers with download requests as acks only: the index is the
+// next chunk it needs, and pushHole is set in it to have chunks resent from
+// there. Nodes which don't ask for push mode, or a config without it, get the
+// usual 8-byte replies, and download one chunk per request.
+const (
+	upgradePush = 0x01             // flag byte of the upgrade request and reply
+	pushHole    = 0x8000           // set in an ack index: resend from there
+	pushWindow  = 16               // chunks sent ahead of the last ack
+	pushPause   = 1 * time.Second  // no more chunks sent until the next ack
+	pushExpire  = 60 * time.Second // the stream is dropped without acks
+)
+
+// pushStream is the state of one node's streamed download.
+type pushStream struct {
+	fw      *firmware
+	swID    uint16
+	base    uint16 // first chunk not acked yet
+	next    uint16 // next chunk to send, rewound on hole reports
+	lastAck time.Time
+}
+
+// pushInterval returns the time between chunks sent to each node, 0 if push
+// mode is disabled.
+func (c *config) pushInterval() time.Duration {
+	return time.Duration(c.Push * float64(time.Millisecond))
+}
+
+// startStream sets up a streamed download, the first chunk is sent on the
+// next tick.
+func (w *JeeBoot) startStream(key nodeKey, swID uint16, fw *firmware,
+	now time.Time) *pushStream {
+	if w.streams == nil {
+		w.streams = map[nodeKey]*pushStream{}
+	}
+	s := &pushStream{fw: fw, swID: swID, lastAck: now}
+	w.streams[key] = s
+	return s
+}
+
+// ackStream handles a download request from a node in push mode. A hole
+// report for an unknown stream, e.g. after a server restart, starts a new one.
+func (w *JeeBoot) ackStream(cfg *nodeConfig, key nodeKey, ack downloadRequest,
+	now time.Time) {
+	s := w.streams[key]
+	if s == nil || s.swID != ack.SwID {
+		fw := w.getFirmware(cfg, key, ack.SwID)
+		if fw == nil || cfg.pushInterval() <= 0 {
+			return
+		}
+		s = w.startStream(key, ack.SwID, fw, now)
+	}
+	s.lastAck = now
+	w.touchDownload(key, now)
+	index := ack.SwIndex &^ pushHole
+	switch {
+	case int(index) >= len(s.fw.chunks):
+		delete(w.streams, key) // all chunks are in
+		w.endDownload(key)
+	case ack.SwIndex&pushHole != 0:
+		s.base, s.next = index, index
+	case index > s.base:
+		s.base = index
+		if s.next < index {
+			s.next = index
+		}
+	}
+}
+
+// pushTicker returns the channel which paces all streams, or nil if there
+// are none. The interval of a new config applies once the ticker restarts.
+func (w *JeeBoot) pushTicker() <-chan time.Time {
+	interval := bootConfig.get().pushInterval()
+	if interval <= 0 {
+		w.streams = nil // push mode was turned off
+	}
+	return runTicker(&w.ticker, len(w.streams) > 0, interval)
+}
+
+// runTicker starts or stops a ticker, and returns its channel, or nil if it
+// is not running.
+func runTicker(t **time.Ticker, active bool, interval time.Duration) <-chan time.Time {
+	switch {
+	case !active && *t != nil:
+		(*t).Stop()
+		*t = nil
+	case active && *t == nil:
+		*t = time.NewTicker(interval)
+	}
+	if *t == nil {
+		return nil
+	}
+	return (*t).C
+}
+
+// pushChunks sends the next chunk of each stream which is within its window,
+// and drops the streams which have not been acked for too long.
+func (w *JeeBoot) pushChunks(now time.Time) {
+	cfg := bootConfig.get()
+	buf := cmdBuffers.Get().(*[]byte)
+	for key, s := range w.streams {
+		idle := now.Sub(s.lastAck)
+		if idle > pushExpire {
+			delete(w.streams, key)
+			continue
+		}
+		if idle > pushPause || s.next >= s.base+pushWindow ||
+			int(s.next) >= len(s.fw.chunks) {
+			continue
+		}
+		cmd := s.fw.appendDownloadCmd((*buf)[:0], s.swID, s.next, hdrDst|key.node)
+		sessions.download(key, s.next, 64, now)
+		if sampleChunk(s.next, len(s.fw.chunks)) {
+			bootLog.add(1, logEvent{kind: logDownload, group: key.group,
+				node: key.node, swID: s.swID, index: s.next})
+		}
+		board := cfg.reg.lookupBoard(key.group, key.node)
+		w.sendCmd(key.group, now.Add(cfg.replyWindow(board)), string(cmd))
+		*buf = cmd
+		s.next++
+	}
+	cmdBuffers.Put(buf)
+}
@@ -0,0 +1,86 @@
+package jeeboot
+
+import (
+	"encoding/hex"
+
+	"github.com/golang/glog"
+)
+
+// nodeInfo is what the config specifies for one node.
+type nodeInfo struct {
+	board, group, node uint8
+	swID               uint16
+}
+
+// nodeSlot is what the request path needs to know about a paired node.
+type nodeSlot struct {
+	swID  uint16
+	board uint8
+}
+
+// registry indexes the HwIDs config entries, so that lookups on the request
+// path are constant-time and do not need to convert the hardware ID.
+type registry struct {
+	byHwID map[[16]byte]nodeInfo
+	slots  [256][32]nodeSlot // per net group and node ID
+}
+
+// lookupHwID returns the assigned board, group, and node, or zeroes.
+func (r *registry) lookupHwID(hwID [16]byte) (board, group, node uint8) {
+	info := r.byHwID[hwID]
+	return info.board, info.group, info.node
+}
+
+// lookupSwID returns the software ID assigned to a node, or 0.
+func (r *registry) lookupSwID(group, node uint8) uint16 {
+	return r.slots[group][node&0x1F].swID
+}
+
+// lookupBoard returns the board type of a node, or 0.
+func (r *registry) lookupBoard(group, node uint8) uint8 {
+	return r.slots[group][node&0x1F].board
+}
+
+// updated returns the registry for a new HwIDs config, leaving r unchanged so
+// that it can still be used concurrently. This is a full rebuild: all hardware
+// IDs are decoded into a new map, and the slot table is copied. Only the slots
+// of nodes which have been added, changed, or removed are written after that.
+// Config changes are rare, it's the lookups which have to be cheap.
+func (r *registry) updated(hwIDs map[string]hwEntry) *registry {
+	n := &registry{byHwID: make(map[[16]byte]nodeInfo, len(hwIDs))}
+	for k, h := range hwIDs {
+		b, err := hex.DecodeString(k)
+		if err != nil || len(b) != 16 {
+			glog.Warningf("ignoring bad hwid %q", k)
+			continue
+		}
+		var id [16]byte
+		copy(id[:], b)
+		n.byHwID[id] = nodeInfo{uint8(h.Board), uint8(h.Group), uint8(h.Node),
+			uint16(h.SwID)}
+	}
+
+	if r != nil {
+		n.slots = r.slots
+		for id, old := range r.byHwID {
+			if info, ok := n.byHwID[id]; !ok || info != old {
+				n.slots[old.group][old.node&0x1F] = nodeSlot{}
+			}
+		}
+	}
+	for id, info := range n.byHwID {
+		slot := &n.slots[info.group][info.node&0x1F]
+		// also re-set slots which were shared with a node that just went away
+		if old, ok := r.lookup(id); !ok || info != old || *slot == (nodeSlot{}) {
+			*slot = nodeSlot{info.swID, info.board}
+		}
+	}
+	return n
+}
+
+func (r *registry) lookup(hwID [16]byte) (info nodeInfo, ok bool) {
+	if r != nil {
+		info, ok = r.byHwID[hwID]
+	}
+	return
+}
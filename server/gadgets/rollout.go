@@ -0,0 +1,203 @@
+package jeeboot
+
+import (
+	"fmt"
+	"io"
+	"sort"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Rollouts: without any, a new swID in the config is picked up by every node
+// it applies to at its next boot, and they all compete for the same channel.
+// The config can roll a swID out in waves instead, i.e.
+//
+//	"rollouts": { "1004": { "canary": 2, "waves": [10, 50, 100], "interval": 600 } }
+//
+// where the first wave holds the canary nodes only (the first ones in group
+// and node order), and each later wave opens after interval seconds and adds
+// a percentage of the nodes. Without an interval, all waves open at once. A
+// rollout starts over when its config changes. Nodes whose wave has not opened yet are told to
+// keep the software they report, if the server has it. Independently of
+// waves, "maxdownloads" caps the downloads in progress per gateway: nodes
+// past it get a busy reply, telling them how many seconds to wait, if their
+// upgrade request has the upgradeBusy flag. Other nodes get no reply, and
+// fall back to their usual back-off.
+const (
+	upgradeBusy  = 0x02             // flag byte: busy reply understood / sent
+	downloadIdle = 30 * time.Second // a download slot is freed without requests
+	busyRetry    = 10               // seconds to wait, per round of queued nodes
+)
+
+// rolloutEntry is the config of one swID rollout.
+type rolloutEntry struct {
+	Canary   float64   // number of nodes in the first wave
+	Waves    []float64 // percentage of all nodes in each of the later waves
+	Interval float64   // seconds between waves, 0 to open them all at once
+
+	canary map[nodeKey]bool
+	plan   string // the settings above, a change restarts the rollout
+}
+
+// parseRollouts converts the Rollouts config once, and picks the canaries.
+func (c *config) parseRollouts() {
+	c.rollouts = map[uint16]*rolloutEntry{}
+	for k, v := range c.Rollouts {
+		id, err := strconv.Atoi(k)
+		if err != nil {
+			continue
+		}
+		var keys []nodeKey
+		for _, h := range c.HwIDs {
+			if uint16(h.SwID) == uint16(id) {
+				keys = append(keys, nodeKey{uint8(h.Group), uint8(h.Node)})
+			}
+		}
+		sort.Sort(byKey(keys))
+		r := v
+		r.plan = fmt.Sprint(v.Canary, v.Waves, v.Interval)
+		r.canary = map[nodeKey]bool{}
+		for i := 0; i < len(keys) && i < int(v.Canary); i++ {
+			r.canary[keys[i]] = true
+		}
+		c.rollouts[uint16(id)] = &r
+	}
+}
+
+type byKey []nodeKey
+
+func (a byKey) Len() int      { return len(a) }
+func (a byKey) Swap(i, j int) { a[i], a[j] = a[j], a[i] }
+func (a byKey) Less(i, j int) bool {
+	return a[i].group < a[j].group ||
+		a[i].group == a[j].group && a[i].node < a[j].node
+}
+
+// rolloutStarts holds the time each rolled out swID was first asked for, with
+// the plan it was started with, it is kept in the state journal.
+var rolloutStarts = struct {
+	sync.Mutex
+	m map[uint16]rolloutRecord
+}{m: map[uint16]rolloutRecord{}}
+
+// rolloutStart returns when the rollout of a swID started, starting it now if
+// it is the first time, or if its plan changed since.
+func rolloutStart(swID uint16, plan string, now time.Time) time.Time {
+	rolloutStarts.Lock()
+	r, ok := rolloutStarts.m[swID]
+	restart := !ok || r.Plan != plan
+	if restart {
+		r = rolloutRecord{swID, now, plan}
+		rolloutStarts.m[swID] = r
+	}
+	rolloutStarts.Unlock()
+	if restart {
+		bootState.put(journalEntry{Key: fmt.Sprintf("r:%d", swID), Rollout: &r})
+	}
+	return r.Start
+}
+
+// restoreRollout sets the start of a rollout from the journal, unless it has
+// been started since the server started.
+func restoreRollout(r *rolloutRecord) {
+	rolloutStarts.Lock()
+	if _, ok := rolloutStarts.m[r.SwID]; !ok {
+		rolloutStarts.m[r.SwID] = *r
+	}
+	rolloutStarts.Unlock()
+}
+
+// nodePercentile spreads the nodes of a rollout evenly over 0..99, in an order
+// which differs per swID, so that the same nodes aren't always first.
+func nodePercentile(key nodeKey, swID uint16) float64 {
+	h := uint32(2166136261) // FNV-1a
+	for _, b := range []byte{key.group, key.node, byte(swID), byte(swID >> 8)} {
+		h ^= uint32(b)
+		h *= 16777619
+	}
+	return float64(h % 100)
+}
+
+// admitWave returns false if the wave of this node has not opened yet.
+func (c *config) admitWave(key nodeKey, swID uint16, now time.Time) bool {
+	r := c.rollouts[swID]
+	if r == nil || r.canary[key] || r.Interval <= 0 {
+		return true
+	}
+	elapsed := now.Sub(rolloutStart(swID, r.plan, now))
+	wave := int(elapsed / time.Duration(r.Interval*float64(time.Second)))
+	switch {
+	case wave == 0:
+		return false
+	case len(r.Waves) == 0:
+		return true
+	case wave > len(r.Waves):
+		wave = len(r.Waves)
+	}
+	return nodePercentile(key, swID) < r.Waves[wave-1]
+}
+
+// admitDownload takes one of the gateway's download slots for a node, and
+// returns 0, or the number of seconds to wait if all of them are taken.
+func (w *JeeBoot) admitDownload(cfg *nodeConfig, key nodeKey, now time.Time) uint8 {
+	for k, t := range w.downloads {
+		if now.Sub(t) > downloadIdle {
+			delete(w.downloads, k)
+		}
+	}
+	for k, t := range w.refused {
+		if now.Sub(t) > downloadIdle {
+			delete(w.refused, k)
+		}
+	}
+	max := int(cfg.MaxDownloads)
+	if _, ok := w.downloads[key]; !ok && max > 0 && len(w.downloads) >= max {
+		if w.refused == nil {
+			w.refused = map[nodeKey]time.Time{}
+		}
+		w.refused[key] = now
+		atomic.AddUint64(&rolloutCounts.busy, 1)
+		// spread the retries out over as many rounds as there are nodes waiting
+		wait := busyRetry * (1 + (len(w.refused)-1)/max)
+		if wait > 255 {
+			wait = 255
+		}
+		return uint8(wait)
+	}
+	delete(w.refused, key)
+	w.touchDownload(key, now)
+	return 0
+}
+
+// touchDownload marks a download as active. Nodes already downloading are
+// never refused, e.g. after a server restart, it would waste their progress.
+func (w *JeeBoot) touchDownload(key nodeKey, now time.Time) {
+	if w.downloads == nil {
+		w.downloads = map[nodeKey]time.Time{}
+	}
+	w.downloads[key] = now
+}
+
+// endDownload frees the download slot and the time slot of a node.
+func (w *JeeBoot) endDownload(key nodeKey) {
+	delete(w.downloads, key)
+	w.releaseSlot(key)
+}
+
+// rolloutCounts counts the nodes held back, in all JeeBoot gadgets.
+var rolloutCounts struct {
+	held uint64 // upgrade requests answered with the node's own software
+	busy uint64 // upgrade requests refused, no download slot free
+}
+
+// writeRolloutMetrics writes the rollout counters, Prometheus style.
+func writeRolloutMetrics(w io.Writer) {
+	fmt.Fprintf(w, "# HELP jeeboot_rollout_held_total Nodes told to wait for their wave.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_rollout_held_total counter\n")
+	fmt.Fprintf(w, "jeeboot_rollout_held_total %d\n", atomic.LoadUint64(&rolloutCounts.held))
+	fmt.Fprintf(w, "# HELP jeeboot_rollout_busy_total Nodes refused, no download slot free.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_rollout_busy_total counter\n")
+	fmt.Fprintf(w, "jeeboot_rollout_busy_total %d\n", atomic.LoadUint64(&rolloutCounts.busy))
+}
@@ -0,0 +1,274 @@
+package jeeboot
+
+import (
+	"encoding/json"
+	"fmt"
+	"io"
+	"net/http"
+	"sort"
+	"sync"
+	"time"
+
+	"github.com/golang/glog"
+	"github.com/jcw/flow"
+)
+
+func init() {
+	flow.Registry["BootStatus"] = func() flow.Circuitry { return &BootStatus{} }
+}
+
+// nodeKey identifies a node by its net group and node ID.
+type nodeKey struct{ group, node uint8 }
+
+// session tracks the progress of one node through the boot protocol.
+type session struct {
+	Group    uint8
+	Node     uint8
+	Phase    string // "pairing", "upgrade", "download", or "done"
+	SwID     uint16
+	Index    int           // last chunk index requested, -1 if none yet
+	Chunks   int           // number of chunks in the image being downloaded
+	Bytes    int           // payload bytes served, including retries
+	Retries  int           // requests for the same chunk index as the last one
+	Gap      time.Duration // time between the last two requests
+	AvgGap   time.Duration // smoothed gap between download requests
+	Eta      time.Duration // estimated time to complete the download
+	Started  time.Time
+	LastSeen time.Time
+
+	// the image this node started downloading, kept even if its file is
+	// reloaded in the meantime, so that the download stays consistent, nil
+	// for a session restored from the state journal until it is looked up
+	fw   *firmware
+	crc  uint16          // of the image, also for a delta
+	base *upgradeRequest // the node's image a delta applies to, nil if none
+}
+
+// sessionTable holds the sessions of all nodes, it can be used concurrently.
+type sessionTable struct {
+	mu    sync.Mutex
+	m     map[nodeKey]*session
+	dirty map[nodeKey]bool // changed since they were last written to the journal
+}
+
+// sessions is shared by all JeeBoot gadgets and the BootStatus server.
+var sessions = &sessionTable{m: map[nodeKey]*session{}, dirty: map[nodeKey]bool{}}
+
+// get returns the session of a node, creating one if needed, and marks it as
+// changed. Must be called with the lock held.
+func (t *sessionTable) get(key nodeKey, now time.Time) *session {
+	s := t.m[key]
+	if s == nil {
+		s = &session{Group: key.group, Node: key.node, Index: -1}
+		t.m[key] = s
+	}
+	t.dirty[key] = true
+	if !s.LastSeen.IsZero() {
+		s.Gap = now.Sub(s.LastSeen)
+	}
+	s.LastSeen = now
+	return s
+}
+
+// pairing records a successful pairing request.
+func (t *sessionTable) pairing(key nodeKey, now time.Time) {
+	t.mu.Lock()
+	s := t.get(key, now)
+	s.Phase = "pairing"
+	t.mu.Unlock()
+}
+
+// upgrade records an upgrade request, which starts a new download of fw, or
+// of a delta from base to it.
+func (t *sessionTable) upgrade(key nodeKey, swID uint16, fw *firmware,
+	base *upgradeRequest, now time.Time) {
+	t.mu.Lock()
+	s := t.get(key, now)
+	*s = session{Group: s.Group, Node: s.Node, Phase: "upgrade", SwID: swID,
+		Index: -1, Chunks: len(fw.chunks), Started: now, LastSeen: now, fw: fw,
+		crc: fw.crc, base: base}
+	t.mu.Unlock()
+}
+
+// pinned returns the image a node is downloading, if it matches swID. In a
+// session restored from the journal, it is looked up again: the image for
+// swID, or the delta to it, as long as it still has the same crc and size.
+func (t *sessionTable) pinned(cfg *nodeConfig, key nodeKey, swID uint16) *firmware {
+	t.mu.Lock()
+	s := t.m[key]
+	if s == nil || s.SwID != swID || s.fw == nil && s.Chunks == 0 {
+		t.mu.Unlock()
+		return nil
+	}
+	fw, crc, base, chunks := s.fw, s.crc, s.base, s.Chunks
+	t.mu.Unlock()
+	if fw != nil {
+		return fw
+	}
+	fw = cfg.GetFirmware(swID)
+	if fw != nil && fw.crc == crc && base != nil {
+		fw = deltaFor(cfg, base, fw)
+	}
+	if fw == nil || fw.crc != crc || len(fw.chunks) != chunks {
+		return nil // changed while the server was down, the node starts over
+	}
+	t.mu.Lock()
+	if s.fw == nil && s.SwID == swID {
+		s.fw = fw
+	}
+	t.mu.Unlock()
+	return fw
+}
+
+// changed returns the sessions changed since the last call, to be written to
+// the journal.
+func (t *sessionTable) changed() []sessionRecord {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	list := make([]sessionRecord, 0, len(t.dirty))
+	for key := range t.dirty {
+		s := t.m[key]
+		r := sessionRecord{*s, s.crc, s.base}
+		r.fw = nil // not needed, and it would keep old images in memory
+		list = append(list, r)
+		delete(t.dirty, key)
+	}
+	return list
+}
+
+// restore adds a session from the journal, unless the node has been heard
+// from since the server started.
+func (t *sessionTable) restore(r *sessionRecord) {
+	t.mu.Lock()
+	key := nodeKey{r.Group, r.Node}
+	if t.m[key] == nil {
+		s := r.session
+		s.crc, s.base = r.Crc, r.Base
+		t.m[key] = &s
+	}
+	t.mu.Unlock()
+}
+
+// download records a download request for which n payload bytes were served.
+func (t *sessionTable) download(key nodeKey, index uint16, n int,
+	now time.Time) {
+	t.mu.Lock()
+	s := t.get(key, now)
+	if int(index) == s.Index {
+		s.Retries++
+	}
+	if s.Phase == "download" {
+		if s.AvgGap == 0 {
+			s.AvgGap = s.Gap
+		}
+		s.AvgGap += (s.Gap - s.AvgGap) / 8
+	}
+	s.Phase = "download"
+	s.Index = int(index)
+	s.Bytes += n
+	if s.Index >= s.Chunks-1 {
+		s.Phase = "done"
+	}
+	s.Eta = time.Duration(s.Chunks-1-s.Index) * s.AvgGap
+	t.mu.Unlock()
+}
+
+// snapshot returns a copy of all sessions, ordered by group and node ID.
+func (t *sessionTable) snapshot() []session {
+	t.mu.Lock()
+	list := make([]session, 0, len(t.m))
+	for _, s := range t.m {
+		list = append(list, *s)
+	}
+	t.mu.Unlock()
+	sort.Sort(byNode(list))
+	return list
+}
+
+type byNode []session
+
+func (a byNode) Len() int      { return len(a) }
+func (a byNode) Swap(i, j int) { a[i], a[j] = a[j], a[i] }
+func (a byNode) Less(i, j int) bool {
+	return a[i].Group < a[j].Group ||
+		a[i].Group == a[j].Group && a[i].Node < a[j].Node
+}
+
+// writeMetrics writes all sessions in the Prometheus text exposition format.
+func (t *sessionTable) writeMetrics(w io.Writer) {
+	list := t.snapshot()
+	metric := func(name, kind, help string, value func(s *session) float64) {
+		fmt.Fprintf(w, "# HELP jeeboot_%s %s\n# TYPE jeeboot_%s %s\n",
+			name, help, name, kind)
+		for i := range list {
+			s := &list[i]
+			fmt.Fprintf(w, "jeeboot_%s{group=\"%d\",node=\"%d\"} %g\n",
+				name, s.Group, s.Node, value(s))
+		}
+	}
+	metric("bytes_served_total", "counter", "Firmware bytes sent to the node.",
+		func(s *session) float64 { return float64(s.Bytes) })
+	metric("retries_total", "counter", "Chunks requested more than once.",
+		func(s *session) float64 { return float64(s.Retries) })
+	metric("chunk_index", "gauge", "Last chunk index requested.",
+		func(s *session) float64 { return float64(s.Index) })
+	metric("chunks", "gauge", "Number of chunks in the image.",
+		func(s *session) float64 { return float64(s.Chunks) })
+	metric("request_gap_seconds", "gauge", "Time between the last two requests.",
+		func(s *session) float64 { return s.Gap.Seconds() })
+	metric("eta_seconds", "gauge", "Estimated time until the download is done.",
+		func(s *session) float64 { return s.Eta.Seconds() })
+	metric("last_seen_seconds", "gauge", "Unix time of the last request.",
+		func(s *session) float64 { return float64(s.LastSeen.Unix()) })
+
+	fmt.Fprintf(w, "# HELP jeeboot_phase Current boot phase of the node.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_phase gauge\n")
+	for _, s := range list {
+		fmt.Fprintf(w, "jeeboot_phase{group=\"%d\",node=\"%d\",phase=\"%s\"} 1\n",
+			s.Group, s.Node, s.Phase)
+	}
+}
+
+// BootStatus serves the session table on a local HTTP address: metrics in
+// Prometheus format on /metrics, including the radio airtime used, and a JSON
+// snapshot on /sessions. The hardware IDs handed out are listed on
+// /assignments.
+type BootStatus struct {
+	flow.Gadget
+	Addr flow.Input
+}
+
+// Start serving, an empty address disables the status server.
+func (g *BootStatus) Run() {
+	m, ok := <-g.Addr
+	addr, _ := m.(string)
+	if !ok || addr == "" {
+		return
+	}
+	mux := http.NewServeMux()
+	mux.HandleFunc("/metrics", func(w http.ResponseWriter, r *http.Request) {
+		w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+		sessions.writeMetrics(w)
+		writeTxMetrics(w)
+		writeSerialMetrics(w)
+		writeStaleMetrics(w)
+		writeRolloutMetrics(w)
+		writeBcastMetrics(w)
+		writeTdmaMetrics(w)
+		chunkStore.writeMetrics(w)
+		bootLog.writeMetrics(w)
+		bootState.writeMetrics(w)
+	})
+	mux.HandleFunc("/sessions", func(w http.ResponseWriter, r *http.Request) {
+		w.Header().Set("Content-Type", "application/json")
+		json.NewEncoder(w).Encode(sessions.snapshot())
+	})
+	mux.HandleFunc("/assignments", func(w http.ResponseWriter, r *http.Request) {
+		w.Header().Set("Content-Type", "application/json")
+		json.NewEncoder(w).Encode(bootState.assignments())
+	})
+	glog.Infof("status server on http://%s/metrics, /sessions, and /assignments", addr)
+	if err := http.ListenAndServe(addr, mux); err != nil {
+		glog.Errorln("status server:", err)
+	}
+}
@@ -0,0 +1,79 @@
+package jeeboot
+
+import (
+	"sync"
+	"sync/atomic"
+)
+
+// firmwareSet is an immutable snapshot of all loaded firmware images, keyed
+// by filename. Neither the map nor the images in it change once published.
+type firmwareSet map[string]*firmware
+
+// firmwareStore publishes firmware snapshots RCU-style: readers never lock,
+// writers copy the current snapshot, change the copy, and swap it in.
+type firmwareStore struct {
+	mu   sync.Mutex   // serializes writers
+	snap atomic.Value // current firmwareSet
+}
+
+// get returns the named firmware in the current snapshot, or nil.
+func (s *firmwareStore) get(name string) *firmware {
+	set, _ := s.snap.Load().(firmwareSet)
+	return set[name]
+}
+
+// publish adds or replaces a fully built firmware image. The chunks of the
+// image it replaces are released, unless it is still published under another
+// name.
+func (s *firmwareStore) publish(name string, fw *firmware) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	old, _ := s.snap.Load().(firmwareSet)
+	set := make(firmwareSet, len(old)+1)
+	for k, v := range old {
+		set[k] = v
+	}
+	set[name] = fw
+	s.snap.Store(set)
+	if prev := old[name]; prev != nil && prev != fw {
+		for _, v := range set {
+			if v == prev {
+				return
+			}
+		}
+		chunkStore.release(prev.chunks)
+	}
+}
+
+// nodeConfig is an immutable snapshot of the config, with its node registry.
+type nodeConfig struct {
+	config
+	reg *registry
+}
+
+// configStore publishes config snapshots in the same way as firmwareStore,
+// so that any number of JeeBoot gadgets can share them without locking.
+type configStore struct {
+	mu   sync.Mutex   // serializes writers
+	snap atomic.Value // current *nodeConfig
+}
+
+var emptyConfig = &nodeConfig{reg: &registry{}}
+
+// get returns the current config, which must not be modified.
+func (s *configStore) get() *nodeConfig {
+	if cfg, ok := s.snap.Load().(*nodeConfig); ok {
+		return cfg
+	}
+	return emptyConfig
+}
+
+// publish switches to a new config, and updates the node registry to match.
+func (s *configStore) publish(cfg config) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	cfg.parseSwIDs()
+	cfg.parseWindows()
+	cfg.parseRollouts()
+	s.snap.Store(&nodeConfig{cfg, s.get().reg.updated(cfg.HwIDs)})
+}
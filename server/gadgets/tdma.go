@@ -0,0 +1,221 @@
+package jeeboot
+
+import (
+	"fmt"
+	"io"
+	"sync/atomic"
+	"time"
+)
+
+// Time slots: nodes downloading at the same time send their requests whenever
+// they have stored the previous chunk, so with a handful of them, requests
+// collide with each other and with the replies, and both sides wait for the
+// reply window to run out. If the config sets "tdma", the length of a time
+// slot in ms, each pull download gets a slot in a frame, which repeats every
+// slot length times the number of slots in use. The reply to a download
+// request is held back just long enough for the node's next request, which it
+// sends as soon as it has stored the chunk, to come in at the start of its own
+// slot. The time from releasing a reply to the next request is measured for
+// each node, so the boot loader needs no change: the reply timing is the slot
+// announcement. The frame has to fit in the reply window, nodes for which
+// there is no slot left are answered right away, as without time slots.
+const (
+	tdmaGuard  = 2 * time.Millisecond // slack at the start of each slot
+	tdmaSmooth = 4                    // weight of the old latency, vs the new
+)
+
+// timeSlot is the slot of one download, and how its node keeps up.
+type timeSlot struct {
+	index   int
+	last    time.Time     // last request
+	sent    time.Time     // last reply released
+	next    uint16        // chunk index expected in the next request
+	latency time.Duration // from releasing a reply to the next request
+}
+
+// heldReply is a reply waiting for its release time.
+type heldReply struct {
+	due, deadline time.Time
+	group         uint8
+	cmd           string
+}
+
+// tdmaSlot returns the length of a time slot, 0 if they are not used.
+func (c *config) tdmaSlot() time.Duration {
+	return time.Duration(c.Tdma * float64(time.Millisecond))
+}
+
+// slotDue returns when to release the reply to a download request, the zero
+// time to send it right away.
+func (w *JeeBoot) slotDue(cfg *nodeConfig, key nodeKey, index uint16) time.Time {
+	slot := cfg.tdmaSlot()
+	if slot <= 0 {
+		return time.Time{}
+	}
+	now := w.arrival
+	if now.IsZero() {
+		now = time.Now()
+	}
+	window := cfg.replyWindow(w.board)
+	s := w.slots[key]
+	if s == nil {
+		if s = w.assignSlot(key, slot, window, now); s == nil {
+			atomic.AddUint64(&tdmaCounts.unslotted, 1)
+			return time.Time{}
+		}
+	}
+	if index == s.next && !s.sent.IsZero() {
+		// a retry or a lost reply would measure the reply window instead
+		if l := now.Sub(s.sent); l > 0 && l < window {
+			if s.latency == 0 {
+				s.latency = l
+			} else {
+				s.latency += (l - s.latency) / tdmaSmooth
+			}
+		}
+	}
+	s.last, s.next, s.sent = now, index+1, now
+	if s.latency == 0 {
+		return time.Time{}
+	}
+
+	// the first start of the node's slot the next request can make it to
+	frame := time.Duration(w.nSlots) * slot
+	t := now.Add(s.latency)
+	phase := (t.Sub(w.slotEpoch) - time.Duration(s.index)*slot - tdmaGuard) % frame
+	if phase < 0 {
+		phase += frame
+	}
+	if phase > 0 {
+		t = t.Add(frame - phase)
+	}
+	if t.Sub(now) > window {
+		return time.Time{} // the node would give up before the reply is sent
+	}
+	s.sent = t.Add(-s.latency)
+	return s.sent
+}
+
+// assignSlot gives a download the first free time slot, or returns nil if all
+// slots which fit in the reply window are taken.
+func (w *JeeBoot) assignSlot(key nodeKey, slot, window time.Duration,
+	now time.Time) *timeSlot {
+	for k, s := range w.slots {
+		if now.Sub(s.last) > downloadIdle {
+			delete(w.slots, k)
+		}
+	}
+	max := int(window * 3 / 4 / slot) // leave time for the reply to get out
+	used := make([]bool, max)
+	for _, s := range w.slots {
+		if s.index < max {
+			used[s.index] = true
+		}
+	}
+	for i := range used {
+		if !used[i] {
+			if w.slots == nil {
+				w.slots = map[nodeKey]*timeSlot{}
+			}
+			if len(w.slots) == 0 {
+				w.slotEpoch = now
+			}
+			s := &timeSlot{index: i, last: now}
+			w.slots[key] = s
+			w.countSlots()
+			return s
+		}
+	}
+	return nil
+}
+
+// releaseSlot frees the time slot of a download, if it had one.
+func (w *JeeBoot) releaseSlot(key nodeKey) {
+	if _, ok := w.slots[key]; ok {
+		delete(w.slots, key)
+		w.countSlots()
+	}
+}
+
+// countSlots sets the number of slots in a frame: up to the last one in use.
+func (w *JeeBoot) countSlots() {
+	w.nSlots = 0
+	for _, s := range w.slots {
+		if s.index >= w.nSlots {
+			w.nSlots = s.index + 1
+		}
+	}
+}
+
+// holdReply queues a reply until its due time, ordered by due time.
+func (w *JeeBoot) holdReply(r heldReply, now time.Time) {
+	i := len(w.held)
+	w.held = append(w.held, r)
+	for ; i > 0 && w.held[i-1].due.After(r.due); i-- {
+		w.held[i] = w.held[i-1]
+	}
+	w.held[i] = r
+	atomic.AddUint64(&tdmaCounts.held, 1)
+	atomic.AddUint64(&tdmaCounts.holdNs, uint64(r.due.Sub(now)))
+	if i == 0 {
+		w.armHold(now)
+	}
+}
+
+// releaseHeld sends the held replies which are due.
+func (w *JeeBoot) releaseHeld(now time.Time) {
+	n := 0
+	for n < len(w.held) && !w.held[n].due.After(now) {
+		w.sendCmd(w.held[n].group, w.held[n].deadline, w.held[n].cmd)
+		n++
+	}
+	w.held = append(w.held[:0], w.held[n:]...)
+	if len(w.held) > 0 {
+		w.armHold(now)
+	}
+}
+
+// armHold sets the hold timer to the first due time.
+func (w *JeeBoot) armHold(now time.Time) {
+	d := w.held[0].due.Sub(now)
+	if w.holdTimer == nil {
+		w.holdTimer = time.NewTimer(d)
+		return
+	}
+	if !w.holdTimer.Stop() {
+		select {
+		case <-w.holdTimer.C:
+		default:
+		}
+	}
+	w.holdTimer.Reset(d)
+}
+
+// holdTimeout returns the hold timer channel, nil if no replies are held.
+func (w *JeeBoot) holdTimeout() <-chan time.Time {
+	if len(w.held) == 0 {
+		return nil
+	}
+	return w.holdTimer.C
+}
+
+// tdmaCounts counts the replies timed to slots, in all JeeBoot gadgets.
+var tdmaCounts struct {
+	held      uint64 // replies held back until the node's slot
+	holdNs    uint64 // total time they were held
+	unslotted uint64 // download replies sent right away, no slot left
+}
+
+// writeTdmaMetrics writes the time slot counters, Prometheus style.
+func writeTdmaMetrics(w io.Writer) {
+	fmt.Fprintf(w, "# HELP jeeboot_tdma_held_total Replies held back until the slot of their node.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_tdma_held_total counter\n")
+	fmt.Fprintf(w, "jeeboot_tdma_held_total %d\n", atomic.LoadUint64(&tdmaCounts.held))
+	fmt.Fprintf(w, "# HELP jeeboot_tdma_hold_seconds_total Time replies were held back.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_tdma_hold_seconds_total counter\n")
+	fmt.Fprintf(w, "jeeboot_tdma_hold_seconds_total %g\n",
+		time.Duration(atomic.LoadUint64(&tdmaCounts.holdNs)).Seconds())
+	fmt.Fprintf(w, "# HELP jeeboot_tdma_unslotted_total Download replies sent without a slot.\n")
+	fmt.Fprintf(w, "# TYPE jeeboot_tdma_unslotted_total counter\n")
+	fmt.Fprintf(w, "jeeboot_tdma_unslotted_total %d\n", atomic.LoadUint64(&tdmaCounts.unslotted))
+}
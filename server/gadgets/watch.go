@@ -0,0 +1,106 @@
+package jeeboot
+
+import (
+	"encoding/json"
+	"io/ioutil"
+	"os"
+	"os/signal"
+	"syscall"
+	"time"
+
+	"github.com/golang/glog"
+	"github.com/jcw/flow"
+)
+
+// watchInterval is how often WatchFiles checks its files for changes.
+var watchInterval = 2 * time.Second
+
+// WatchFiles passes on each file name it receives, and sends it out again
+// whenever that file changes. Changes are checked for periodically, and right
+// away when the process receives a SIGHUP. Names already seen are ignored.
+type WatchFiles struct {
+	flow.Gadget
+	In  flow.Input
+	Out flow.Output
+}
+
+// Start watching, this keeps running after the input has been closed.
+func (w *WatchFiles) Run() {
+	mtimes := map[string]time.Time{}
+
+	hup := make(chan os.Signal, 1)
+	signal.Notify(hup, syscall.SIGHUP)
+	defer signal.Stop(hup)
+	ticker := time.NewTicker(watchInterval)
+	defer ticker.Stop()
+
+	in := w.In
+	for {
+		select {
+		case m, ok := <-in:
+			if !ok {
+				in = nil
+				continue
+			}
+			if name, ok := m.(string); ok {
+				if _, seen := mtimes[name]; !seen {
+					mtimes[name] = modTime(name)
+					w.Out.Send(name)
+				}
+			}
+		case <-ticker.C:
+			w.sendChanged(mtimes)
+		case <-hup:
+			glog.Infoln("SIGHUP, checking for changed files")
+			w.sendChanged(mtimes)
+		}
+	}
+}
+
+// sendChanged sends out the names of all files modified since the last check.
+func (w *WatchFiles) sendChanged(mtimes map[string]time.Time) {
+	for name, t := range mtimes {
+		if mt := modTime(name); !mt.Equal(t) && !mt.IsZero() {
+			glog.Infoln("reloading", name)
+			mtimes[name] = mt
+			w.Out.Send(name)
+		}
+	}
+}
+
+// ReadConfigJSON reads each file named on In and sends out its decoded JSON.
+// Unlike ReadFileJSON, it logs and skips a file which can't be read or
+// decoded, e.g. one which is only half saved: it will be sent again once its
+// writer is done with it, and a reload must not bring down the server.
+type ReadConfigJSON struct {
+	flow.Gadget
+	In  flow.Input
+	Out flow.Output
+}
+
+// Start reading, this ends when the input is closed.
+func (g *ReadConfigJSON) Run() {
+	for m := range g.In {
+		name, ok := m.(string)
+		if !ok {
+			continue
+		}
+		var v interface{}
+		data, err := ioutil.ReadFile(name)
+		if err == nil {
+			err = json.Unmarshal(data, &v)
+		}
+		if err != nil {
+			glog.Errorln("config not loaded, keeping the previous one:", err)
+			continue
+		}
+		g.Out.Send(v)
+	}
+}
+
+func modTime(name string) time.Time {
+	if info, err := os.Stat(name); err == nil {
+		return info.ModTime()
+	}
+	return time.Time{}
+}
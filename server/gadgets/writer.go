@@ -0,0 +1,281 @@
+package jeeboot
+
+import (
+	"fmt"
+	"io"
+	"sort"
+	"sync"
+	"time"
+
+	"github.com/jcw/flow"
+)
+
+func init() {
+	flow.Registry["SerialWriter"] = func() flow.Circuitry { return &SerialWriter{} }
+}
+
+const (
+	writeQueueMax = 32  // pending writes per port, the oldest bulk one is dropped
+	writeBatchMax = 512 // bytes combined into one write to the serial port
+)
+
+type queuedWrite struct {
+	data     []byte
+	other    flow.Message // anything else, passed on by itself
+	queued   time.Time
+	deadline time.Time // data is dropped after this, unless it's zero
+	bulk     bool      // a download chunk, dropped before control replies
+}
+
+// writeQueue sits in front of one serial port. Everything queued while the
+// port is busy goes out as a single write. When the port falls too far behind
+// the oldest pending download chunk is dropped, it's the least likely to still
+// be of any use to the node waiting for it, and the node will simply ask for it
+// again. Control replies, e.g. to pairing and upgrade requests, are only
+// dropped when there are no chunks left to drop. Writes past their deadline
+// are dropped.
+type writeQueue struct {
+	mu      sync.Mutex
+	ready   sync.Cond
+	items   []queuedWrite
+	closed  bool
+	stats   *writeStats
+	sep     []byte // separator between the writes in one batch
+	pending []queuedWrite
+}
+
+func newWriteQueue(port string, sep string) *writeQueue {
+	q := &writeQueue{stats: writeStatsFor(port), sep: []byte(sep)}
+	q.ready.L = &q.mu
+	return q
+}
+
+// push queues an item, with a copy of its data.
+func (q *writeQueue) push(item queuedWrite) {
+	item.data = append([]byte(nil), item.data...)
+	q.mu.Lock()
+	if len(q.items) >= writeQueueMax {
+		drop := 0 // the oldest one, unless there's a chunk to drop instead
+		for i := range q.items {
+			if q.items[i].bulk {
+				drop = i
+				break
+			}
+		}
+		q.items = append(q.items[:drop], q.items[drop+1:]...)
+		q.stats.countDropped()
+	}
+	q.items = append(q.items, item)
+	q.stats.setDepth(len(q.items))
+	q.mu.Unlock()
+	q.ready.Signal()
+}
+
+// close lets drain return once everything queued has been written.
+func (q *writeQueue) close() {
+	q.mu.Lock()
+	q.closed = true
+	q.mu.Unlock()
+	q.ready.Signal()
+}
+
+// take waits for pending writes, and moves as many as fit in one batch to
+// q.pending. A message other than data is always taken by itself.
+func (q *writeQueue) take() bool {
+	q.mu.Lock()
+	defer q.mu.Unlock()
+	for len(q.items) == 0 && !q.closed {
+		q.ready.Wait()
+	}
+	q.pending = q.pending[:0]
+	size := 0
+	now := time.Now()
+	for len(q.items) > 0 {
+		item := q.items[0]
+		if !item.deadline.IsZero() && now.After(item.deadline) {
+			q.items = q.items[1:]
+			q.stats.countStale()
+			continue
+		}
+		if len(q.pending) > 0 &&
+			(item.other != nil || size+len(item.data) > writeBatchMax) {
+			break
+		}
+		q.pending = append(q.pending, item)
+		q.items = q.items[1:]
+		size += len(item.data) + len(q.sep)
+		if item.other != nil {
+			break
+		}
+	}
+	q.stats.setDepth(len(q.items))
+	return len(q.pending) > 0 || !q.closed
+}
+
+// drain writes out batches until the queue is closed and empty, or a write
+// fails. Other messages are passed to send, which may be nil if there are none.
+func (q *writeQueue) drain(write func([]byte) error, send func(flow.Message)) error {
+	var buf []byte
+	for q.take() {
+		if len(q.pending) == 0 {
+			continue // all of them were stale
+		}
+		if other := q.pending[0].other; other != nil {
+			send(other)
+			continue
+		}
+		buf = buf[:0]
+		for i, item := range q.pending {
+			if i > 0 {
+				buf = append(buf, q.sep...)
+			}
+			buf = append(buf, item.data...)
+		}
+		if err := write(buf); err != nil {
+			return err
+		}
+		q.stats.written(len(q.pending), time.Since(q.pending[0].queued))
+	}
+	return nil
+}
+
+// writeStats tracks the write queue of one serial port.
+type writeStats struct {
+	mu sync.Mutex
+	writeCounts
+}
+
+type writeCounts struct {
+	depth    int
+	writes   int
+	commands int
+	dropped  int
+	stale    int
+	latency  time.Duration // summed over all written commands
+	maxDelay time.Duration // largest latency since the last scrape
+}
+
+var (
+	writeStatsMu sync.Mutex
+	writePorts   = map[string]*writeStats{}
+)
+
+// writeStatsFor returns the counters of a serial port.
+func writeStatsFor(port string) *writeStats {
+	writeStatsMu.Lock()
+	defer writeStatsMu.Unlock()
+	st := writePorts[port]
+	if st == nil {
+		st = &writeStats{}
+		writePorts[port] = st
+	}
+	return st
+}
+
+func (st *writeStats) setDepth(n int) {
+	st.mu.Lock()
+	st.depth = n
+	st.mu.Unlock()
+}
+
+func (st *writeStats) countDropped() {
+	st.mu.Lock()
+	st.dropped++
+	st.mu.Unlock()
+}
+
+func (st *writeStats) countStale() {
+	st.mu.Lock()
+	st.stale++
+	st.mu.Unlock()
+}
+
+// written records one batch, the latency is that of its oldest command.
+func (st *writeStats) written(n int, latency time.Duration) {
+	st.mu.Lock()
+	st.writes++
+	st.commands += n
+	st.latency += time.Duration(n) * latency
+	if latency > st.maxDelay {
+		st.maxDelay = latency
+	}
+	st.mu.Unlock()
+}
+
+// writeSerialMetrics writes the queue counters of all ports, Prometheus style.
+func writeSerialMetrics(w io.Writer) {
+	writeStatsMu.Lock()
+	ports := make([]string, 0, len(writePorts))
+	for port := range writePorts {
+		ports = append(ports, port)
+	}
+	writeStatsMu.Unlock()
+	sort.Strings(ports)
+
+	stats := make([]writeCounts, len(ports))
+	for i, port := range ports {
+		st := writeStatsFor(port)
+		st.mu.Lock()
+		stats[i] = st.writeCounts
+		st.maxDelay = 0
+		st.mu.Unlock()
+	}
+	metric := func(name, kind, help string, value func(st *writeCounts) float64) {
+		fmt.Fprintf(w, "# HELP jeeboot_serial_%s %s\n# TYPE jeeboot_serial_%s %s\n",
+			name, help, name, kind)
+		for i := range stats {
+			fmt.Fprintf(w, "jeeboot_serial_%s{port=%q} %g\n",
+				name, ports[i], value(&stats[i]))
+		}
+	}
+	metric("queue_depth", "gauge", "Commands waiting to be written.",
+		func(st *writeCounts) float64 { return float64(st.depth) })
+	metric("writes_total", "counter", "Writes to the serial port.",
+		func(st *writeCounts) float64 { return float64(st.writes) })
+	metric("commands_total", "counter", "Commands written, in all writes.",
+		func(st *writeCounts) float64 { return float64(st.commands) })
+	metric("dropped_total", "counter", "Commands dropped, the port was too slow.",
+		func(st *writeCounts) float64 { return float64(st.dropped) })
+	metric("stale_total", "counter", "Commands dropped, past their deadline.",
+		func(st *writeCounts) float64 { return float64(st.stale) })
+	metric("latency_seconds_sum", "counter", "Time from queueing to written.",
+		func(st *writeCounts) float64 { return st.latency.Seconds() })
+	metric("latency_max_seconds", "gauge", "Largest latency since the last scrape.",
+		func(st *writeCounts) float64 { return st.maxDelay.Seconds() })
+}
+
+// SerialWriter sits in front of the To pin of a SerialPort gadget, and sends
+// out all commands which arrived while the port was busy as one message. The
+// Port input only names the port in the metrics. A "<deadline>" tag applies to
+// the command after it. Anything other than strings is passed on by itself.
+type SerialWriter struct {
+	flow.Gadget
+	Port flow.Input
+	In   flow.Input
+	Out  flow.Output
+}
+
+// Start passing on commands, this ends once the input is closed.
+func (g *SerialWriter) Run() {
+	port, _ := (<-g.Port).(string)
+	q := newWriteQueue(port, " ") // RF12demo skips the spaces
+	go func() {
+		var deadline time.Time
+		for m := range g.In {
+			if t, ok := m.(flow.Tag); ok && t.Tag == "<deadline>" {
+				deadline = t.Msg.(time.Time)
+			} else if s, ok := m.(string); ok {
+				q.push(queuedWrite{data: []byte(s), queued: time.Now(),
+					deadline: deadline, bulk: isBulk(s)})
+				deadline = time.Time{}
+			} else {
+				q.push(queuedWrite{other: m, queued: time.Now()})
+			}
+		}
+		q.close()
+	}()
+	q.drain(func(b []byte) error {
+		g.Out.Send(string(b))
+		return nil
+	}, g.Out.Send)
+}
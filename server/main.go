@@ -4,6 +4,9 @@ package main
 import (
 	"flag"
 	"fmt"
+	"os"
+	"strconv"
+	"strings"
 
 	"github.com/jcw/flow"
 	_ "github.com/jcw/flow/gadgets"
@@ -27,8 +30,73 @@ var (
 		"net group used to listen for incoming JeeBoot requests")
 	configFile = flag.String("config", "config.json",
 		"configuration file containing the swid/hwid details")
+	httpAddr = flag.String("http", "localhost:8080",
+		"local address to serve /metrics and /sessions on, empty to disable")
+	binary = flag.Bool("binary", false,
+		"gateways run the jeeLinkBin sketch with binary framing, not RF12demo")
+	baudRate = flag.Int("baud", 500000,
+		"serial baud rate for binary gateways, must match the jeeLinkBin sketch")
+	stateFile = flag.String("state", "jeeboot.state",
+		"journal file to keep node state in across restarts, empty to disable,\n"+
+			"after which nodes in the middle of a download start over")
+	gateways gatewayList
 )
 
+func init() {
+	flag.Var(&gateways, "gw",
+		"gateway as dev:band:group[,group...], repeat for more gateways")
+}
+
+// gateway is a serial port with an attached JeeLink/JeeNode running RF12demo.
+// With more than one group it listens on all of them, which needs an RF12B,
+// and the jeeLinkBin sketch, to know the group of each request and reply.
+type gateway struct {
+	dev    string
+	band   int
+	groups []int
+}
+
+// rf12Group returns the group to set up the radio with.
+func (gw gateway) rf12Group() int {
+	if len(gw.groups) > 1 {
+		return 0 // listen on all groups, JeeBoot filters the ones it wants
+	}
+	return gw.groups[0]
+}
+
+// rf12Init returns the RF12demo command to set up band and group(s).
+func (gw gateway) rf12Init() string {
+	return fmt.Sprintf("%db %dg 31i 1c 1q v", gw.band/100, gw.rf12Group())
+}
+
+// gatewayList collects all the -gw flags.
+type gatewayList []gateway
+
+func (l *gatewayList) String() string {
+	return fmt.Sprint(*l)
+}
+
+func (l *gatewayList) Set(s string) error {
+	f := strings.Split(s, ":")
+	if len(f) != 3 {
+		return fmt.Errorf("expected dev:band:group[,group...], got %q", s)
+	}
+	band, err := strconv.Atoi(f[1])
+	if err != nil {
+		return err
+	}
+	var groups []int
+	for _, g := range strings.Split(f[2], ",") {
+		group, err := strconv.Atoi(g)
+		if err != nil {
+			return err
+		}
+		groups = append(groups, group)
+	}
+	*l = append(*l, gateway{f[0], band, groups})
+	return nil
+}
+
 func main() {
 	flag.Parse()
 
@@ -38,37 +106,94 @@ func main() {
 		return
 	}
 
-	// main processing pipeline: serial, rf12demo, jeeboot, serial
-	// firmware: jeeboot, readtext, intelhex, binaryfill, calccrc, bootdata
+	if len(gateways) == 0 {
+		gateways = gatewayList{{*serialPort, *freqBand, []int{*netGroup}}}
+	}
+	for _, gw := range gateways {
+		// in 0g mode, RF12demo neither reports the group nor can send to one
+		if len(gw.groups) > 1 && !*binary {
+			fmt.Fprintf(os.Stderr, "gateway %s: more than one group needs -binary\n",
+				gw.dev)
+			os.Exit(2)
+		}
+	}
+
+	// main processing pipeline, per gateway: serial, rf12demo, stamparrival,
+	// jeeboot, airtime, serialwriter, serial - stamparrival times requests
+	// before they queue up, airtime keeps the replies within the duty cycle,
+	// serialwriter combines them when the serial port is busy
+	// with -binary, jeelinkbin replaces serial, rf12demo, and stamparrival
+	// config: watchfiles, readconfigjson, jeeboot (of the first gateway)
+	// firmware: jeeboot, watchfiles, readtext, intelhex, binaryfill, calccrc,
+	// bootdata - the watchers re-send changed files, also after a SIGHUP
 	// other valid packets are routed to the bootServer gadget
+	// all gateways share the config and firmware, replies are sent out
+	// through the same gateway as the request they belong to
+	// include the pairing group 212 in a gateway's groups to pair new nodes
+	// state: the assignments, sessions, and rollouts are kept in a journal
 
 	c := flow.NewCircuit()
-	c.Add("sp", "SerialPort")
-	c.Add("rf", "Sketch-RF12demo")
-	c.Add("sk", "Sink")
-	c.Add("cf", "ReadFileJSON")
-	c.Add("jb", "JeeBoot")
+	c.Add("wc", "WatchFiles")
+	c.Add("cf", "ReadConfigJSON")
+	c.Add("wf", "WatchFiles")
 	c.Add("rd", "ReadFileText")
 	c.Add("hx", "IntelHexToBin")
 	c.Add("bf", "BinaryFill")
 	c.Add("cs", "CalcCrc16")
 	c.Add("bd", "BootData")
-	c.Add("sv", "BootServer")
-	c.Connect("sp.From", "rf.In", 0)
-	c.Connect("rf.Out", "sv.In", 0)
-	c.Connect("rf.Rej", "sk.In", 0) // throw away rejected serial port msgs
-	c.Connect("rf.Oob", "jb.In", 0)
-	c.Connect("cf.Out", "jb.Cfg", 0)
-	c.Connect("jb.Files", "rd.In", 0)
+	c.Add("hs", "BootStatus")
+	c.Add("st", "BootState")
+	c.Connect("wc.Out", "cf.In", 0)
+	c.Connect("cf.Out", "jb0.Cfg", 0)
+	c.Connect("jb0.Files", "wf.In", 0)
+	c.Connect("wf.Out", "rd.In", 0)
 	c.Connect("rd.Out", "hx.In", 0)
 	c.Connect("hx.Out", "bf.In", 0)
 	c.Connect("bf.Out", "cs.In", 0)
 	c.Connect("cs.Out", "bd.In", 0)
-	c.Connect("jb.Out", "sp.To", 0)
-	c.Connect("sv.Out", "sp.To", 0)
-	c.Feed("sp.Port", *serialPort)
-	c.Feed("cf.In", *configFile)
+	c.Feed("wc.In", *configFile)
 	c.Feed("bf.Len", 64)
+	c.Feed("hs.Addr", *httpAddr)
+	c.Feed("st.Path", *stateFile)
+
+	for i, gw := range gateways {
+		n := strconv.Itoa(i)
+		c.Add("jb"+n, "JeeBoot")
+		c.Add("tx"+n, "Airtime")
+		c.Add("sv"+n, "BootServer")
+		if *binary {
+			c.Add("jl"+n, "JeeLinkBin")
+			c.Connect("jl"+n+".Out", "sv"+n+".In", 0)
+			c.Connect("jl"+n+".Oob", "jb"+n+".In", 0)
+			c.Connect("tx"+n+".Out", "jl"+n+".In", 0)
+			c.Feed("jl"+n+".Port", gw.dev)
+			c.Feed("jl"+n+".Baud", *baudRate)
+			c.Feed("jl"+n+".Band", gw.band)
+			c.Feed("jl"+n+".Group", gw.rf12Group())
+		} else {
+			c.Add("sp"+n, "SerialPort")
+			c.Add("rf"+n, "Sketch-RF12demo")
+			c.Add("sk"+n, "Sink")
+			c.Add("sw"+n, "SerialWriter")
+			c.Add("ar"+n, "StampArrival")
+			c.Connect("sp"+n+".From", "rf"+n+".In", 0)
+			c.Connect("rf"+n+".Out", "sv"+n+".In", 0)
+			c.Connect("rf"+n+".Rej", "sk"+n+".In", 0) // throw away rejected msgs
+			c.Connect("rf"+n+".Oob", "ar"+n+".In", 0)
+			c.Connect("ar"+n+".Out", "jb"+n+".In", 0)
+			c.Connect("tx"+n+".Out", "sw"+n+".In", 0)
+			c.Connect("sv"+n+".Out", "sw"+n+".In", 0)
+			c.Connect("sw"+n+".Out", "sp"+n+".To", 0)
+			c.Feed("sp"+n+".Port", gw.dev)
+			c.Feed("sw"+n+".Port", gw.dev)
+			c.Feed("sv"+n+".Init", gw.rf12Init())
+		}
+		c.Connect("jb"+n+".Out", "tx"+n+".In", 0)
+		c.Feed("tx"+n+".Band", gw.band)
+		for _, group := range gw.groups {
+			c.Feed("jb"+n+".Group", group)
+		}
+	}
 
 	if *describe {
 		flow.PrintDescription(c)
@@ -82,16 +207,22 @@ func init() {
 	flow.Registry["BootServer"] = func() flow.Circuitry { return new(BootServer) }
 }
 
+// BootServer initializes RF12demo on one gateway, and reports other packets.
+// Its Init command selects the band, and either one group or all of them.
+// Without an Init command, as for binary gateways, it only reports packets.
 type BootServer struct {
 	flow.Gadget
-	In  flow.Input
-	Out flow.Output
+	In   flow.Input
+	Init flow.Input // RF12demo command to set up band and group
+	Out  flow.Output
 }
 
 func (g *BootServer) Run() {
-	g.Out.Send(1) // reset the serial port
-	<-g.In        // wait for some input before sending out the init command
-	g.Out.Send(fmt.Sprintf("%db %dg 31i 1c 1q v", *freqBand/100, *netGroup))
+	if cmd, ok := <-g.Init; ok {
+		g.Out.Send(1) // reset the serial port
+		<-g.In        // wait for some input before sending out the init command
+		g.Out.Send(cmd)
+	}
 
 	for m := range g.In {
 		fmt.Println("in:", m)